@@ -0,0 +1,208 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <random>
+
+#include "benchmark/benchmark.h"
+#include "op_trie.h"
+
+// 统计堆分配次数，用于观察匹配过程中的内存分配
+// 替换全部new/delete形式（数组、nothrow、sized、对齐），都配对到malloc/free（对齐的用aligned_alloc）
+static std::atomic<size_t> g_alloc_count{0};
+
+static void* counted_alloc(size_t size, size_t align) noexcept {
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  size = size == 0 ? 1 : size;
+  if (align <= alignof(std::max_align_t)) {
+    return std::malloc(size);
+  }
+  // aligned_alloc要求大小是对齐的整数倍
+  return std::aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+static void* counted_alloc_or_throw(size_t size, size_t align) {
+  if (void* p = counted_alloc(size, align)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new(size_t size) {
+  return counted_alloc_or_throw(size, 0);
+}
+
+void* operator new[](size_t size) {
+  return counted_alloc_or_throw(size, 0);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, 0);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+  return counted_alloc_or_throw(size, static_cast<size_t>(align));
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+  return counted_alloc_or_throw(size, static_cast<size_t>(align));
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+using optrie::MatchEngine;
+using optrie::OpTrie;
+
+const OpTrie& sample_trie() {
+  static OpTrie trie;
+  static std::once_flag loaded;
+  std::call_once(loaded, [] {
+    trie.load({OPTRIE_EXAMPLE_DIR "/sample.tpl"}, {OPTRIE_EXAMPLE_DIR "/sample.dic"});
+  });
+  return trie;
+}
+
+void run_match(benchmark::State& state, const std::wstring& query) {
+  auto& trie = sample_trie();
+  // 预热，排除thread_local缓冲首次分配
+  benchmark::DoNotOptimize(trie.match(query));
+  size_t allocs = 0;
+  for (auto _ : state) {
+    size_t before = g_alloc_count.load(std::memory_order_relaxed);
+    auto res = trie.match(query);
+    allocs += g_alloc_count.load(std::memory_order_relaxed) - before;
+    benchmark::DoNotOptimize(res);
+  }
+  state.counters["allocs_per_match"] =
+      benchmark::Counter(static_cast<double>(allocs), benchmark::Counter::kAvgIterations);
+}
+
+void BM_MatchHit(benchmark::State& state) {
+  run_match(state, L"查询上海房价");
+}
+
+void BM_MatchMiss(benchmark::State& state) {
+  run_match(state, L"深圳的房价是多少");
+}
+
+void BM_MatchLongMiss(benchmark::State& state) {
+  run_match(state, std::wstring(64, L'上'));
+}
+
+// 模糊匹配密集的模板集：单字和[W:0-3]交替，每个位置都有多种切分，DFS要大量回溯
+OpTrie& wildcard_trie() {
+  static OpTrie trie;
+  static std::once_flag loaded;
+  std::call_once(loaded, [] {
+    auto tpl_file = std::filesystem::temp_directory_path() / "optrie_bench_wildcard.tpl";
+    std::mt19937 rng(42);
+    {
+      std::ofstream fo(tpl_file);
+      for (int i = 0; i < 200; ++i) {
+        std::string tpl;
+        for (int j = 0; j < 7; ++j) {
+          tpl += rng() % 2 ? "a" : "b";
+          tpl += "[W:0-3]";
+        }
+        fo << tpl << "c\t1\n";
+      }
+    }
+    trie.load({tpl_file.string()}, {});
+    std::filesystem::remove(tpl_file);
+  });
+  return trie;
+}
+
+// 比较两种引擎，Arg(0): DFS，Arg(1): BITMASK
+void BM_WildcardEngine(benchmark::State& state) {
+  auto engine = state.range(0) ? MatchEngine::BITMASK : MatchEngine::DFS;
+  auto& trie = wildcard_trie().set_engine(engine);
+  state.SetLabel(state.range(0) ? "bitmask" : "dfs");
+  // 查询：随机的a/b串，结尾分别为c（可能命中）和d（必然不命中）
+  std::mt19937 rng(7);
+  std::vector<std::wstring> queries;
+  for (int i = 0; i < 64; ++i) {
+    std::wstring query;
+    for (int j = 0; j < 19; ++j) {
+      query += rng() % 2 ? L'a' : L'b';
+    }
+    query += i % 2 ? L'c' : L'd';
+    queries.emplace_back(query);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(trie.match(queries[i++ % queries.size()]));
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_MatchHit);
+BENCHMARK(BM_MatchMiss);
+BENCHMARK(BM_MatchLongMiss);
+BENCHMARK(BM_WildcardEngine)->Arg(0)->Arg(1);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,162 @@
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "benchmark/benchmark.h"
+#include "op_trie.h"
+#include "synthetic_data.h"
+
+// 大规模合成数据上的加载、匹配耗时和内存
+// 规模用环境变量调整（见SyntheticConfig::from_env），例如：
+//    OPTRIE_BENCH_TEMPLATES=10000 OPTRIE_BENCH_DICT_WORDS=100000 ./scale_benchmark
+// 机器可读的结果用google benchmark自带的参数写到文件（加载日志会打到stdout，不要用stdout上的json）：
+//    ./scale_benchmark --benchmark_out=result.json --benchmark_out_format=json
+
+namespace {
+
+using optrie::OpTrie;
+using optrie::bench::SyntheticConfig;
+using optrie::bench::SyntheticData;
+
+// 每类查询的个数，匹配时循环使用
+const size_t NUM_QUERIES = 1024;
+
+struct Fixture {
+  SyntheticConfig config;
+  std::string tpl_file;
+  std::string dict_file;
+  std::vector<std::wstring> hit_queries;
+  std::vector<std::wstring> near_miss_candidates;
+  std::vector<std::wstring> random_queries;
+};
+
+const Fixture& fixture() {
+  static Fixture fixture;
+  static std::once_flag generated;
+  std::call_once(generated, [] {
+    fixture.config = SyntheticConfig::from_env();
+    SyntheticData data(fixture.config);
+    auto dir = std::filesystem::temp_directory_path();
+    fixture.tpl_file = (dir / "optrie_bench_scale.tpl").string();
+    fixture.dict_file = (dir / "optrie_bench_scale.dic").string();
+    data.write(fixture.tpl_file, fixture.dict_file);
+    fixture.hit_queries = data.hit_queries(NUM_QUERIES);
+    fixture.near_miss_candidates = data.near_miss_queries(NUM_QUERIES * 4);
+    fixture.random_queries = data.random_queries(NUM_QUERIES);
+  });
+  return fixture;
+}
+
+void set_scale_counters(benchmark::State& state, const SyntheticConfig& config) {
+  state.counters["templates"] = static_cast<double>(config.num_templates);
+  state.counters["dict_words"] = static_cast<double>(config.num_dict_words);
+  state.counters["wildcard_density"] = config.wildcard_density;
+}
+
+// 当前进程的常驻内存（字节），不支持的平台返回0
+size_t rss_bytes() {
+#ifndef _WIN32
+  std::ifstream fi("/proc/self/statm");
+  size_t total = 0, resident = 0;
+  if (fi >> total >> resident) {
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  }
+#endif
+  return 0;
+}
+
+const OpTrie& scale_trie() {
+  static OpTrie trie;
+  static std::once_flag loaded;
+  std::call_once(loaded, [] {
+    auto& f = fixture();
+    trie.load({f.tpl_file}, {f.dict_file});
+  });
+  return trie;
+}
+
+// 改掉最后一个字后仍可能被其他模板（如结尾是模糊匹配的）匹配上，只保留真正不匹配的
+const std::vector<std::wstring>& near_miss_queries() {
+  static std::vector<std::wstring> queries;
+  static std::once_flag filtered;
+  std::call_once(filtered, [] {
+    auto& trie = scale_trie();
+    for (auto& query : fixture().near_miss_candidates) {
+      if (queries.size() < NUM_QUERIES && !trie.match(query).matched) {
+        queries.emplace_back(query);
+      }
+    }
+    if (queries.empty()) {
+      queries = fixture().near_miss_candidates;
+    }
+  });
+  return queries;
+}
+
+// 从文件加载（解析 + 建树 + 冻结），内存为加载前后常驻内存之差和冻结后镜像的大小
+void BM_Load(benchmark::State& state) {
+  auto& f = fixture();
+  double rss_delta = 0, image_size = 0;
+  for (auto _ : state) {
+    size_t before = rss_bytes();
+    auto trie = std::make_unique<OpTrie>();
+    trie->load({f.tpl_file}, {f.dict_file});
+    state.PauseTiming();
+    rss_delta += static_cast<double>(rss_bytes()) - static_cast<double>(before);
+    auto image_file = std::filesystem::temp_directory_path() / "optrie_bench_scale.optrie";
+    trie->save(image_file.string());
+    image_size += static_cast<double>(std::filesystem::file_size(image_file));
+    std::filesystem::remove(image_file);
+    trie.reset();
+    state.ResumeTiming();
+  }
+  set_scale_counters(state, f.config);
+  state.counters["rss_bytes"] = benchmark::Counter(rss_delta, benchmark::Counter::kAvgIterations,
+                                                   benchmark::Counter::kIs1024);
+  state.counters["image_bytes"] = benchmark::Counter(image_size, benchmark::Counter::kAvgIterations,
+                                                     benchmark::Counter::kIs1024);
+}
+
+void run_match(benchmark::State& state, const std::vector<std::wstring>& queries) {
+  auto& trie = scale_trie();
+  size_t i = 0, matched = 0;
+  for (auto _ : state) {
+    auto res = trie.match(queries[i++ % queries.size()]);
+    matched += res.matched;
+    benchmark::DoNotOptimize(res);
+  }
+  set_scale_counters(state, fixture().config);
+  state.counters["hit_rate"] =
+      benchmark::Counter(static_cast<double>(matched), benchmark::Counter::kAvgIterations);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// 按模板实例化的查询，必然命中
+void BM_ScaleMatchHit(benchmark::State& state) {
+  run_match(state, fixture().hit_queries);
+}
+
+// 实例化后改掉最后一个字，前面的算子都能走通，到最后才失败
+void BM_ScaleMatchNearMiss(benchmark::State& state) {
+  run_match(state, near_miss_queries());
+}
+
+// 随机串，大多在前几个算子就失败
+void BM_ScaleMatchRandom(benchmark::State& state) {
+  run_match(state, fixture().random_queries);
+}
+
+}  // namespace
+
+BENCHMARK(BM_Load)->Unit(benchmark::kMillisecond)->Iterations(1);
+BENCHMARK(BM_ScaleMatchHit)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_ScaleMatchNearMiss)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_ScaleMatchRandom)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
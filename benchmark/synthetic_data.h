@@ -0,0 +1,197 @@
+#ifndef __OP_TRIE_SYNTHETIC_DATA_H__
+#define __OP_TRIE_SYNTHETIC_DATA_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace optrie {
+namespace bench {
+
+// 合成数据的规模，默认按README中sample.tpl/sample.dic的形状放大
+// 都可以用环境变量覆盖，见from_env
+struct SyntheticConfig {
+  size_t num_templates = 100000;    // 模板数
+  size_t num_dict_words = 1000000;  // 所有词典的总词数
+  size_t num_dicts = 50;            // 词典个数
+  double wildcard_density = 0.3;    // 每个模板项是模糊匹配的概率
+  size_t query_len = 12;            // 随机查询的长度
+  uint32_t seed = 42;
+
+  // OPTRIE_BENCH_TEMPLATES / OPTRIE_BENCH_DICT_WORDS / OPTRIE_BENCH_DICTS /
+  // OPTRIE_BENCH_WILDCARD / OPTRIE_BENCH_QUERY_LEN / OPTRIE_BENCH_SEED
+  static SyntheticConfig from_env() {
+    SyntheticConfig config;
+    env("OPTRIE_BENCH_TEMPLATES", config.num_templates);
+    env("OPTRIE_BENCH_DICT_WORDS", config.num_dict_words);
+    env("OPTRIE_BENCH_DICTS", config.num_dicts);
+    env("OPTRIE_BENCH_WILDCARD", config.wildcard_density);
+    env("OPTRIE_BENCH_QUERY_LEN", config.query_len);
+    env("OPTRIE_BENCH_SEED", config.seed);
+    // 每个词典至少一个词，否则引用它的模板加载失败
+    config.num_dicts = std::max<size_t>(config.num_dicts, 1);
+    config.num_dict_words = std::max(config.num_dict_words, config.num_dicts);
+    config.num_templates = std::max<size_t>(config.num_templates, 1);
+    return config;
+  }
+
+ private:
+  template <class T>
+  static void env(const char* name, T& value) {
+    if (const char* str = std::getenv(name)) {
+      value = static_cast<T>(std::atof(str));
+    }
+  }
+};
+
+// 模板项，生成查询时按它实例化
+struct SyntheticPart {
+  enum Kind { LITERAL, WILDCARD, DICT } kind;
+  std::wstring literal;  // LITERAL
+  size_t min_len;        // WILDCARD
+  size_t max_len;
+  size_t dict;           // DICT: 词典下标
+};
+
+// 合成的模板和词典
+// 模板由1~3个字的明文、[W:min-max]、[D:dN]组成2~4项，词典词为2~4个字
+class SyntheticData {
+ public:
+  explicit SyntheticData(const SyntheticConfig& config) : _config(config), _rng(config.seed) {
+    _dicts.resize(config.num_dicts);
+    for (size_t i = 0; i < config.num_dict_words; ++i) {
+      _dicts[i % config.num_dicts].emplace_back(random_chars(2, 4));
+    }
+    for (size_t i = 0; i < config.num_templates; ++i) {
+      std::vector<SyntheticPart> parts;
+      size_t num_parts = 2 + _rng() % 3;
+      for (size_t j = 0; j < num_parts; ++j) {
+        SyntheticPart part;
+        double r = std::uniform_real_distribution<double>(0, 1)(_rng);
+        if (r < config.wildcard_density) {
+          part.kind = SyntheticPart::WILDCARD;
+          part.min_len = _rng() % 2;
+          part.max_len = part.min_len + 1 + _rng() % 2;
+        } else if (r < config.wildcard_density + (1 - config.wildcard_density) / 2) {
+          part.kind = SyntheticPart::DICT;
+          part.dict = _rng() % config.num_dicts;
+        } else {
+          part.kind = SyntheticPart::LITERAL;
+          part.literal = random_chars(1, 3);
+        }
+        parts.emplace_back(part);
+      }
+      _templates.emplace_back(parts);
+    }
+  }
+
+  // 模板文件的行
+  std::vector<std::string> template_lines() const {
+    std::vector<std::string> lines;
+    for (auto& parts : _templates) {
+      std::string tpl;
+      for (auto& part : parts) {
+        if (part.kind == SyntheticPart::LITERAL) {
+          tpl += wstring_to_utf8(part.literal);
+        } else if (part.kind == SyntheticPart::WILDCARD) {
+          tpl += "[W:" + std::to_string(part.min_len) + "-" + std::to_string(part.max_len) + "]";
+        } else {
+          tpl += dict_name(part.dict);
+        }
+      }
+      lines.emplace_back(tpl + "\t1");
+    }
+    return lines;
+  }
+
+  // 写成模板文件和词典文件
+  void write(const std::string& tpl_file, const std::string& dict_file) const {
+    std::ofstream fo(tpl_file);
+    for (auto& line : template_lines()) {
+      fo << line << '\n';
+    }
+    std::ofstream fd(dict_file);
+    for (size_t i = 0; i < _dicts.size(); ++i) {
+      fd << dict_name(i) << '\n';
+      for (auto& word : _dicts[i]) {
+        fd << wstring_to_utf8(word) << '\n';
+      }
+    }
+  }
+
+  // 按随机模板实例化的查询，必然能匹配（不一定是这个模板）
+  std::vector<std::wstring> hit_queries(size_t n) {
+    std::vector<std::wstring> queries;
+    for (size_t i = 0; i < n; ++i) {
+      queries.emplace_back(instantiate(_templates[_rng() % _templates.size()]));
+    }
+    return queries;
+  }
+
+  // 实例化后把最后一个字换成字符集之外的字，前面都能走通，最后才失败，回溯最多
+  // 结尾是模糊匹配的模板仍可能匹配，需要的话由调用方过滤
+  std::vector<std::wstring> near_miss_queries(size_t n) {
+    auto queries = hit_queries(n);
+    for (auto& query : queries) {
+      query.back() = L'＃';
+    }
+    return queries;
+  }
+
+  // 字符集内的随机串，长度为config.query_len
+  std::vector<std::wstring> random_queries(size_t n) {
+    std::vector<std::wstring> queries;
+    for (size_t i = 0; i < n; ++i) {
+      queries.emplace_back(random_chars(_config.query_len, _config.query_len));
+    }
+    return queries;
+  }
+
+ private:
+  // 常用汉字区的前500个字
+  std::wstring random_chars(size_t min_len, size_t max_len) {
+    size_t len = min_len + _rng() % (max_len - min_len + 1);
+    std::wstring s;
+    for (size_t i = 0; i < len; ++i) {
+      s += static_cast<wchar_t>(0x4E00 + _rng() % 500);
+    }
+    return s;
+  }
+
+  static std::string dict_name(size_t i) {
+    return "[D:d" + std::to_string(i) + "]";
+  }
+
+  std::wstring instantiate(const std::vector<SyntheticPart>& parts) {
+    std::wstring query;
+    for (auto& part : parts) {
+      if (part.kind == SyntheticPart::LITERAL) {
+        query += part.literal;
+      } else if (part.kind == SyntheticPart::WILDCARD) {
+        query += random_chars(part.min_len, part.max_len);
+      } else {
+        auto& words = _dicts[part.dict];
+        query += words[_rng() % words.size()];
+      }
+    }
+    // 模板全是可以为空的模糊匹配时，补一个字
+    return query.empty() ? random_chars(1, 1) : query;
+  }
+
+  SyntheticConfig _config;
+  std::mt19937 _rng;
+  std::vector<std::vector<std::wstring>> _dicts;
+  std::vector<std::vector<SyntheticPart>> _templates;
+};
+
+}  // namespace bench
+}  // namespace optrie
+
+#endif  // __OP_TRIE_SYNTHETIC_DATA_H__
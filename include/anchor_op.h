@@ -0,0 +1,26 @@
+#ifndef __OP_TRIE_ANCHOR_OP_H__
+#define __OP_TRIE_ANCHOR_OP_H__
+
+#include "op.h"
+
+namespace optrie {
+
+// 锚点算子，不消耗字符（表达式：[^] 串首，[$] 串尾）
+// 只能写在模板开头（[^]）或结尾（[$]），主要用于子串搜索，整串匹配时总能满足
+class AnchorOpNode : public OpNode {
+ public:
+  AnchorOpNode(const std::string& expr) : OpNode(expr) {
+    init();
+  }
+
+  virtual void freeze(FrozenNode& node, FrozenTrieBuilder& builder) const;
+
+ private:
+  void init();
+
+  bool _at_begin;  // true: 串首，false: 串尾
+};
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_ANCHOR_OP_H__
@@ -4,39 +4,143 @@
 #include "op.h"
 
 #include <set>
+#include <string_view>
 
 namespace optrie {
 
-using WordSet = std::set<std::wstring>;
+// std::less<> 支持用 std::wstring_view 直接查找（异构查找）
+using WordSet = std::set<std::wstring, std::less<>>;
+
+// 前缀树节点
+struct DictTrieNode {
+  uint32_t edge_begin;  // 出边区间[edge_begin, edge_end)
+  uint32_t edge_end;
+  uint32_t is_word;     // 根到当前节点是否是一个词
+};
+
+// 词典前缀树的只读视图，数组可以在堆上（DictTrie），也可以在映射的镜像文件里
+// 节点按层序存放，每个节点的出边在labels/targets中是连续一段，按字符排序
+class DictTrieView {
+ public:
+  DictTrieView() : _num_words(0) {}
+  DictTrieView(ArrayView<DictTrieNode> nodes, ArrayView<wchar_t> labels,
+               ArrayView<uint32_t> targets, size_t num_words)
+      : _nodes(nodes), _labels(labels), _targets(targets), _num_words(num_words) {}
+
+  /**
+   * 从s[pos]开始沿树往下走，最多走max_len个字符
+   * Returns: 长度小于64的词的长度位图（第i位为1表示s.substr(pos, i)是词）
+   * Params:
+   *    depth: 实际走到的深度，超过63时更长的词需要用contains逐个确认
+   */
+  uint64_t prefix_lengths(std::wstring_view s, size_t pos, size_t max_len, size_t& depth) const;
+
+  // 是否包含整个词
+  bool contains(std::wstring_view word) const;
+
+  inline size_t size() const {
+    return _num_words;
+  }
+
+  inline ArrayView<DictTrieNode> nodes() const {
+    return _nodes;
+  }
+
+  inline ArrayView<wchar_t> labels() const {
+    return _labels;
+  }
+
+  inline ArrayView<uint32_t> targets() const {
+    return _targets;
+  }
+
+ private:
+  // 沿字符ch往下走，不存在时返回0（ROOT不会是任何节点的子节点）
+  uint32_t child(uint32_t node, wchar_t ch) const;
+
+  ArrayView<DictTrieNode> _nodes;  // 下标0为ROOT
+  ArrayView<wchar_t> _labels;      // 出边字符
+  ArrayView<uint32_t> _targets;    // 出边指向的节点
+  size_t _num_words;
+};
+
+// 词典编译成的字符前缀树（只读），从某个位置出发走一遍即可枚举所有以该位置开头的词
+class DictTrie {
+ public:
+  explicit DictTrie(const WordSet& words);
+
+  // 视图指向自身的数组，不能拷贝
+  DictTrie(const DictTrie&) = delete;
+  DictTrie& operator=(const DictTrie&) = delete;
+
+  inline const DictTrieView& view() const {
+    return _view;
+  }
+
+ private:
+  std::vector<DictTrieNode> _nodes;
+  std::vector<wchar_t> _labels;
+  std::vector<uint32_t> _targets;
+  DictTrieView _view;
+};
 
 class PatternDict {
  public:
+  /**
+   * Params:
+   *    pat: 词典名，[D:xxx]
+   *    dict: 词典编译成的前缀树
+   *    lengths: 词典中出现过的所有词长
+   */
   void get(const std::string& pat,
-           std::shared_ptr<WordSet>& words, size_t& min_len, size_t& max_len) const;
+           std::shared_ptr<const DictTrie>& dict, LengthSet& lengths) const;
 
+  // 加载词典文件，新词并入已有词典
   void load(const std::vector<std::string>& dict_files);
 
+  // 从内存加载，text为词典文件的内容
+  void load_text(std::string_view text);
+
+  // 从内存加载，{词典名: 词列表}，词典名可以省略外面的[D:]
+  void load(const std::map<std::string, std::vector<std::string>>& dicts);
+
  private:
+  // 每个词典的若干个有序词表，按先后顺序
+  using WordRunsMap = std::map<std::string, std::vector<std::vector<std::wstring>*>>;
+
+  // 解析若干个词典文件的内容，sources用于日志
+  void load_texts(const std::vector<std::string_view>& texts, const std::vector<std::string>& sources);
+
+  // 把解析好的词并入词典，重建有变化的词典
+  void merge(WordRunsMap& grouped);
+
   std::map<std::string, std::shared_ptr<WordSet>> _pat_words_map;     // {dict_type: {set of words}}
-  std::map<std::string, std::pair<size_t, size_t>> _pat_length_range; // {dict_type: (min_len, max_len)}
+  std::map<std::string, std::shared_ptr<const DictTrie>> _pat_tries;  // {dict_type: 编译后的前缀树}
+  std::map<std::string, LengthSet> _pat_lengths;                      // {dict_type: 所有词长}
 };
 
 // 字典匹配算子（表达式：[D:dict_name]）
 class DictOpNode : public OpNode {
  public:
-  DictOpNode(const std::string& expr, const PatternDict& pat_dic) : OpNode(expr) {
-    init(pat_dic);
+  DictOpNode(const std::string& expr, const PatternDict& pat_dic) : OpNode(expr), _pat_dic(&pat_dic) {
+    init();
   }
 
-  virtual MatchIterator match(const std::wstring& s, size_t start) const;
+  virtual void freeze(FrozenNode& node, FrozenTrieBuilder& builder) const;
+
+  // 只包含词典中实际出现的词长
+  virtual LengthSet lengths() const;
+
+  // 重新从词典取词长
+  virtual void refresh();
 
  private:
 
-  void init(const PatternDict& pat_dic);
+  void init();
 
-  virtual bool match_next(const std::wstring& s, size_t start, size_t length) const;
+  LengthSet _lengths;  // 词典中出现过的所有词长（冻结时再取前缀树，热更新后重新冻结就能用上新词）
 
-  std::shared_ptr<WordSet> _words;
+  const PatternDict* _pat_dic;
 };
 
 }  // namespace optrie
@@ -0,0 +1,379 @@
+#ifndef __OP_TRIE_FROZEN_TRIE_H__
+#define __OP_TRIE_FROZEN_TRIE_H__
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dict_op.h"
+#include "length_set.h"
+#include "template_stats.h"
+#include "utils.h"
+
+namespace optrie {
+
+// 算子类型
+enum class OpKind : uint8_t {
+  ROOT,
+  LITERAL,       // 字面（完全）匹配
+  WILDCARD,      // 模糊匹配
+  DICT,          // 字典匹配
+  ANCHOR_BEGIN,  // 串首锚点
+  ANCHOR_END,    // 串尾锚点
+};
+
+// 冻结后的节点记录，匹配时只用下标访问，不再经过shared_ptr
+// 节点按层序存放，同一节点的子节点在数组里是连续的一段
+struct FrozenNode {
+  uint32_t child_begin;     // 子节点区间[child_begin, child_end)
+  uint32_t child_end;
+  uint32_t min_len;         // 当前节点支持的最小长度
+  uint32_t max_len;         // 当前节点支持的最大长度
+  uint32_t child_min_len;   // 子树支持的最小长度
+  uint32_t child_max_len;   // 子树支持的最大长度
+  uint32_t lengths;         // 自身能匹配的长度集合，在长度位图池中的偏移
+  uint32_t child_lengths;   // 子树能匹配的长度集合，在长度位图池中的偏移
+  uint32_t arg;             // LITERAL: 字符池偏移；DICT: 词典下标
+  uint32_t arg_len;         // LITERAL: 字面长度
+  uint32_t tpl_id;          // 可终止时，对应模板信息的下标（有多个模板时为第一个，见FrozenTemplate::next）
+  OpKind kind;
+  bool is_end;              // 是否可以终止匹配
+  bool literal_indexed;     // 整串都是字面的模板（ROOT下的字面叶子），整串匹配时由字面索引查找，不逐个尝试
+  bool dispatched;          // 子节点多，有分派表（见FrozenTrie::node_dispatch、ChildCursor）
+  double score;             // 可终止时的置信度
+  double subtree_max_score; // 子树（含自身）中可终止节点的最高分
+
+  // 判断剩余字符串长度能否塞进至少一个子树中
+  // to_end为false时（子串搜索）不要求用完剩余字符串
+  inline bool can_fit_in_children(size_t length, bool to_end) const {
+    return length >= child_min_len && (!to_end || length <= child_max_len);
+  }
+
+  // 剩余rest个字符时，当前节点可以匹配的最短长度（需要给子树留够长度）
+  inline size_t match_min_len(size_t rest, bool to_end) const {
+    return to_end ? max(min_len, relu(rest - child_max_len)) : min_len;
+  }
+
+  // 剩余rest个字符时，当前节点可以匹配的最长长度
+  inline size_t match_max_len(size_t rest) const {
+    return min(max_len, relu(rest - child_min_len));
+  }
+};
+
+// 字符串池中的[offset, offset + len)
+struct FrozenString {
+  uint32_t offset;
+  uint32_t len;
+};
+
+// 字面索引（开放寻址的哈希表）的一项，node为0表示空位
+struct FrozenLiteral {
+  uint32_t node;   // 字面叶子的节点下标
+  uint32_t prior;  // ROOT下排在它之前、不在索引中的子节点数，为0时整串匹配的首个结果必然是它
+};
+
+// 子节点分派表的一格（开放寻址），end为0表示空位
+// 下一个字符为ch时首字符对得上的子节点在分派池中的位置：[begin, mid)为普通子节点，[mid, end)为字面索引中的字面叶子，各自按下标升序
+struct FrozenDispatchSlot {
+  uint32_t ch;
+  uint32_t begin;
+  uint32_t mid;
+  uint32_t end;
+};
+
+// 子节点多的节点按下一个字符筛选子节点的分派表
+struct FrozenDispatch {
+  uint32_t slot_begin;  // 分派格[slot_begin, slot_begin + num_slots)，num_slots为2的幂
+  uint32_t num_slots;
+  uint32_t any_begin;   // 不看首字符、总要尝试的子节点（模糊匹配、锚点、首字符太多的词典），分派池中的[any_begin, any_end)
+  uint32_t any_end;
+};
+
+// 模板的字段（extra的键值、抽取项），字符串都是字符串池中的[偏移, 长度)
+struct FrozenField {
+  uint32_t key;
+  uint32_t key_len;
+  uint32_t value;      // extractors中为抽取的节点在路径上的下标
+  uint32_t value_len;  // extractors中不用
+};
+
+// 可终止节点对应的模板信息
+struct FrozenTemplate {
+  uint32_t tpl;              // 模板，字符串池中的[偏移, 长度)
+  uint32_t tpl_len;
+  uint32_t extra_begin;      // 额外payload，字段区间[extra_begin, extra_end)，按key排序
+  uint32_t extra_end;
+  uint32_t extractor_begin;  // 需要抽取的节点映射，字段区间[extractor_begin, extractor_end)，按key排序
+  uint32_t extractor_end;
+  uint32_t next;             // 同一终止节点上的下一个模板（规范化后等价的模板项），0表示没有；同一节点的模板连续存放
+  double score;              // 置信度
+};
+
+class FrozenTrie;
+
+// 冻结过程中收集节点和算子参数，最后一次性写成连续的镜像
+class FrozenTrieBuilder {
+ public:
+  // 追加字面字符，返回在字符池中的偏移
+  uint32_t add_chars(const std::wstring& chars);
+
+  // 登记词典（同一词典只存一份），返回下标
+  uint32_t add_dict(std::shared_ptr<const DictTrie> dict);
+
+  // 追加长度集合，返回在长度位图池中的偏移（所有集合容量相同）
+  uint32_t add_length_set(const LengthSet& lengths);
+
+  // 追加模板信息，返回下标；has_next表示同一终止节点上紧接着还有模板
+  uint32_t add_template(const std::string& tpl, double score,
+                        const std::map<std::string, std::string>& extra,
+                        const std::map<std::string, size_t>& extractors, bool has_next = false);
+
+  // 追加字符串，返回在字符串池中的位置
+  FrozenString add_string(const std::string& str);
+
+  // 节点都填好后，把ROOT下的字面叶子建成字面索引
+  void index_literals();
+
+  // 字面索引建好后，为子节点多的节点建分派表
+  void index_children();
+
+  // 写成镜像，返回在镜像上的冻结树
+  std::unique_ptr<FrozenTrie> build() const;
+
+  std::vector<FrozenNode> nodes;          // 节点，下标0为ROOT
+  std::vector<FrozenString> node_exprs;   // 节点表达式，下标同nodes
+
+ private:
+  std::vector<wchar_t> _chars;
+  std::vector<std::shared_ptr<const DictTrie>> _dicts;
+  std::vector<FrozenTemplate> _templates;
+  std::vector<FrozenField> _fields;
+  std::string _strings;
+  std::vector<uint64_t> _length_words;
+  size_t _length_set_words = 0;
+  std::vector<FrozenLiteral> _literals;
+  std::vector<uint32_t> _node_dispatch;
+  std::vector<FrozenDispatch> _dispatches;
+  std::vector<FrozenDispatchSlot> _dispatch_slots;
+  std::vector<uint32_t> _dispatch_children;
+};
+
+/**
+ * 冻结（只读）的算子树，所有匹配都在它上面进行
+ * 数据都在一块连续的镜像里，内部只用相对镜像起点的偏移，和加载的地址无关：
+ * load之后在堆上生成，save原样写入文件，open时直接映射文件，不做反序列化
+ */
+class FrozenTrie {
+ public:
+  // 镜像格式版本，布局变化时递增
+  static const uint32_t IMAGE_VERSION = 5;
+
+  // 子节点不少于这个数时才建分派表，少的时候逐个尝试更快
+  static constexpr uint32_t DISPATCH_MIN_CHILDREN = 8;
+  // 首字符多于这个数的词典不按首字符分派，总是尝试，避免分派池过大
+  static constexpr uint32_t DISPATCH_MAX_DICT_CHARS = 4096;
+  // node_dispatch中表示没有分派表
+  static constexpr uint32_t NO_DISPATCH = UINT32_MAX;
+
+  /**
+   * 在镜像上构造，解析头部并校验段内下标，不拷贝数据；镜像损坏时抛异常
+   * Params:
+   *    data: 镜像起点，需要8字节对齐
+   *    size: 镜像字节数
+   *    owner: 持有镜像内存，冻结树存活期间不释放
+   */
+  FrozenTrie(const void* data, size_t size, std::shared_ptr<const void> owner);
+
+  // 映射镜像文件（只读），格式或版本不对时抛异常
+  static std::unique_ptr<FrozenTrie> open(const std::string& path);
+
+  // 把镜像写入文件（先写临时文件再改名，不影响正在映射旧文件的进程）
+  void save(const std::string& path) const;
+
+  // 把镜像拷贝到匿名共享内存（只读），fork出的子进程共用同一份物理页
+  std::unique_ptr<FrozenTrie> to_shared_memory() const;
+
+  // 偏移为offset的长度集合是否包含len
+  inline bool has_length(uint32_t offset, size_t len) const {
+    return len < length_set_words * 64 && (length_words[offset + len / 64] >> (len % 64) & 1);
+  }
+
+  // 剩余长度为length时，能否塞进node的至少一个子树中
+  // 整串匹配时按精确的长度集合判断，子串搜索时只需要不短于最小长度
+  inline bool can_fit_in_children(const FrozenNode& node, size_t length, bool to_end) const {
+    return node.can_fit_in_children(length, to_end) && (!to_end || has_length(node.child_lengths, length));
+  }
+
+  // 字符串池中的[offset, offset + len)
+  inline std::string_view str(uint32_t offset, uint32_t len) const {
+    return std::string_view(strings.data() + offset, len);
+  }
+
+  // 终止节点上的模板个数（规范化后等价的模板项共用终止节点），模板下标为[node.tpl_id, node.tpl_id + 个数)
+  inline uint32_t num_templates(const FrozenNode& node) const {
+    if (!node.is_end) {
+      return 0;
+    }
+    uint32_t id = node.tpl_id;
+    while (templates[id].next != 0) {
+      id = templates[id].next;
+    }
+    return id - node.tpl_id + 1;
+  }
+
+  // 整串等于s的字面模板在字面索引中的项，没有时返回空
+  const FrozenLiteral* find_literal(std::wstring_view s) const;
+
+  // 分派表中首字符为ch的格，没有时返回空
+  const FrozenDispatchSlot* find_dispatch(const FrozenDispatch& dispatch, wchar_t ch) const;
+
+  // 节点的表达式，如[D:location]，只用于调试和分析，匹配不用
+  inline std::string_view expr(uint32_t node_id) const {
+    return str(node_exprs[node_id].offset, node_exprs[node_id].len);
+  }
+
+  inline const void* image_data() const {
+    return _data;
+  }
+
+  inline size_t image_size() const {
+    return _size;
+  }
+
+  ArrayView<FrozenNode> nodes;           // 节点，下标0为ROOT
+  ArrayView<FrozenString> node_exprs;    // 节点表达式，下标同nodes
+  ArrayView<wchar_t> chars;              // 字面算子的字符池
+  std::vector<DictTrieView> dicts;       // 字典算子用到的词典（前缀树）
+  ArrayView<FrozenTemplate> templates;   // 可终止节点的模板信息
+  ArrayView<FrozenField> fields;         // 模板的字段
+  ArrayView<char> strings;               // 模板的字符串池
+  ArrayView<uint64_t> length_words;      // 长度位图池
+  ArrayView<FrozenLiteral> literals;     // 字面索引，大小为0或2的幂
+  ArrayView<uint32_t> node_dispatch;     // 节点的分派表下标，下标同nodes，子节点少的为NO_DISPATCH
+  ArrayView<FrozenDispatch> dispatches;  // 分派表
+  ArrayView<FrozenDispatchSlot> dispatch_slots;
+  ArrayView<uint32_t> dispatch_children; // 分派池（子节点下标）
+  size_t length_set_words = 0;           // 每个长度集合占用的uint64个数
+
+  // ROOT到各节点路径上最大长度之和的最大值，即子串搜索时从起始位置最远能到的距离（不在镜像里，构造时算出）
+  size_t max_span = 0;
+
+  // 按模板下标的运行时计数（不在镜像里），开启模板统计时匹配线程写入
+  std::shared_ptr<TemplateCounters> template_counters;
+
+ private:
+  // 逐个节点校验各段中的下标和偏移（顺带算出max_span），越界时抛异常
+  void validate();
+
+  const void* _data;
+  size_t _size;
+  std::shared_ptr<const void> _owner;
+};
+
+// 每个节点的匹配结果
+struct OpResult {
+  OpResult(size_t start, size_t length, uint32_t node)
+      : start(start), length(length), node(node) {}
+
+  size_t start;   // 字符串起始位置
+  size_t length;  // 匹配长度
+  uint32_t node;  // 节点下标
+};
+
+// 每个节点的匹配结果
+class MatchIterator {
+ public:
+  /**
+   * Params:
+   *    trie: 冻结的树
+   *    node: 要匹配的节点
+   *    s: 要匹配的字符串视图，调用方保证迭代期间有效
+   *    pos_start: 起始位置
+   *    to_end: 是否要求子树匹配到串尾（子串搜索时为false）
+   */
+  MatchIterator(const FrozenTrie& trie, const FrozenNode& node, std::wstring_view s,
+                size_t pos_start, bool to_end);
+
+  /**
+   * 迭代至下一个hit的结果
+   * Returns: 存在下一个匹配时返回true，否则返回false
+   * Params:
+   *    length: 存在下一个匹配时改为匹配的片段长度，否则不变
+   */
+  bool next(size_t& length);
+
+  // 打印（stdout）debug信息
+  void debug_info() const;
+
+ private:
+  // 判断从起始位置开始、长度为length的片段能否匹配
+  bool match_next(size_t length) const;
+
+  // 匹配length之后，剩余部分的长度能否被子树精确匹配
+  inline bool fit_children(size_t length) const {
+    return !_to_end || _trie.has_length(_node.child_lengths, _rest - length);
+  }
+
+  const FrozenTrie& _trie;  // 冻结的树
+  const FrozenNode& _node;  // 算子
+  std::wstring_view _s;     // 要匹配的字符串（只持有视图，不拷贝）
+
+  size_t _pos_start;   // 要匹配的起始位置
+  int64_t _len_start;  // 长度范围起始
+  int64_t _len_end;    // 长度范围结束
+  int64_t _len_step;   // 长度范围步长，±1
+  size_t _rest;        // 剩余字符串长度
+  bool _to_end;        // 是否要求子树匹配到串尾
+
+  // 字典算子：构造时沿词典前缀树走一遍，得到所有可匹配的长度
+  // 长度>=64的（只在调大最大匹配长度时出现）仍按长度范围逐个确认，先于_hits从长到短迭代
+  uint64_t _hits;      // 可匹配长度的位图（<64）
+};
+
+/**
+ * 按下标从小到大枚举有分派表的节点在pos处可能匹配的子节点，顺序和逐个尝试时一致（首个匹配的结果不变）
+ * 只合并首字符对得上的子节点和总要尝试的子节点；
+ * 整串匹配时字面索引中的字面叶子只给出literal_hit（见FrozenTrie::find_literal，0为没有）
+ */
+class ChildCursor {
+ public:
+  ChildCursor(const FrozenTrie& trie, uint32_t node_id, std::wstring_view s, size_t pos,
+              bool to_end, uint32_t literal_hit);
+
+  // ranges可能指向成员，不能拷贝
+  ChildCursor(const ChildCursor&) = delete;
+  ChildCursor& operator=(const ChildCursor&) = delete;
+
+  /**
+   * Returns: 还有子节点时返回true
+   * Params:
+   *    child: 下一个子节点的下标
+   */
+  inline bool next(uint32_t& child) {
+    // 几段有序下标中取最小的
+    Range* min_range = nullptr;
+    for (auto& range : _ranges) {
+      if (range.first != range.second && (min_range == nullptr || *range.first < *min_range->first)) {
+        min_range = &range;
+      }
+    }
+    if (min_range == nullptr) {
+      return false;
+    }
+    child = *min_range->first++;
+    return true;
+  }
+
+ private:
+  using Range = std::pair<const uint32_t*, const uint32_t*>;
+
+  uint32_t _literal_hit;
+  Range _ranges[3];  // 首字符对得上的普通子节点、字面叶子、总要尝试的子节点
+};
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_FROZEN_TRIE_H__
@@ -0,0 +1,62 @@
+#ifndef __OP_TRIE_LENGTH_SET_H__
+#define __OP_TRIE_LENGTH_SET_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace optrie {
+
+// 长度集合（位图），可容纳[0, capacity]内的长度，超出的长度会被丢弃
+// 用于记录算子/子树可以匹配的精确长度，比[min, max]区间剪枝更准
+class LengthSet {
+ public:
+  explicit LengthSet(size_t capacity = 0) : _capacity(capacity), _bits(capacity / 64 + 1, 0) {}
+
+  inline size_t capacity() const {
+    return _capacity;
+  }
+
+  inline void set(size_t len) {
+    if (len <= _capacity) {
+      _bits[len / 64] |= uint64_t(1) << (len % 64);
+    }
+  }
+
+  // 加入[min_len, max_len]内的所有长度
+  void set_range(size_t min_len, size_t max_len);
+
+  inline bool test(size_t len) const {
+    return len <= _capacity && (_bits[len / 64] >> (len % 64) & 1);
+  }
+
+  bool empty() const;
+
+  // 最小/最大长度，集合为空时分别返回(size_t)-1和0
+  size_t min() const;
+  size_t max() const;
+
+  // 求并集
+  LengthSet& operator|=(const LengthSet& other);
+
+  // 求交集
+  LengthSet& operator&=(const LengthSet& other);
+
+  // 闵可夫斯基和 {a + b | a ∈ this, b ∈ other}，超出capacity的丢弃
+  LengthSet sum(const LengthSet& other) const;
+
+  inline const std::vector<uint64_t>& words() const {
+    return _bits;
+  }
+
+ private:
+  // 把other左移shift位后并入当前集合
+  void or_shifted(const LengthSet& other, size_t shift);
+
+  size_t _capacity;
+  std::vector<uint64_t> _bits;
+};
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_LENGTH_SET_H__
@@ -12,13 +12,11 @@ class LiteralOpNode : public OpNode {
     init();
   }
 
-  virtual MatchIterator match(const std::wstring& s, size_t start) const;
+  virtual void freeze(FrozenNode& node, FrozenTrieBuilder& builder) const;
 
  private:
   void init();
 
-  virtual bool match_next(const std::wstring& s, size_t start, size_t length) const;
-
   std::wstring _w_expr;
 };
 
@@ -0,0 +1,74 @@
+#ifndef __OP_TRIE_MASK_ENGINE_H__
+#define __OP_TRIE_MASK_ENGINE_H__
+
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "frozen_trie.h"
+
+namespace optrie {
+
+// 整串匹配使用的引擎
+enum class MatchEngine : uint8_t {
+  DFS,      // 回溯匹配（默认）
+  BITMASK,  // 位并行：先算出每个节点能成功的位置，回溯时只走必然成功的分支；串长超过63时回退到DFS
+};
+
+// 位并行的可达位置计算（只用于整串匹配）
+// 每个节点用一个uint64_t记录“该节点匹配结束时可能所在的位置”，
+// 字面/模糊/词典算子都变成对掩码的移位和按位或：
+//    1. 按层序从上往下传播一遍，得到从ROOT出发能到达的位置
+//    2. 再从下往上收回一遍，只保留之后还能匹配到串尾的位置
+// 每个节点每次查询只计算一次，和有多少条路径到达它无关，模糊匹配多的模板集耗时更平稳
+class MaskEngine {
+ public:
+  // 位置0~len都要占一位，所以串长最多63
+  static const size_t MAX_QUERY_LEN = 63;
+
+  /**
+   * 计算每个节点的可成功位置
+   * Returns: 是否存在能匹配到串尾的模板
+   * Params:
+   *    trie: 冻结的树
+   *    s: 要匹配的字符串，长度不能超过MAX_QUERY_LEN
+   */
+  bool run(const FrozenTrie& trie, std::wstring_view s);
+
+  // 节点是否在任何位置都无法成功
+  inline bool dead(uint32_t node) const {
+    return _alive[node] == 0;
+  }
+
+  // 节点匹配结束于pos之后，能否继续匹配到串尾
+  inline bool alive(uint32_t node, size_t pos) const {
+    return _alive[node] >> pos & 1;
+  }
+
+ private:
+  // 词典算子在某个起始位置命中的所有结束位置，收回时复用，不再查词典
+  struct DictHit {
+    uint32_t node;
+    uint32_t pos;
+    uint64_t ends;
+  };
+
+  // 从parent的结束位置集合出发，node能到达的结束位置
+  uint64_t forward(const FrozenTrie& trie, uint32_t node, uint64_t from, std::wstring_view s);
+
+  // 字符ch在串中出现位置的掩码
+  uint64_t char_mask(wchar_t ch) const;
+
+  // node能成功的结束位置为to时，它可以从parent的哪些结束位置出发
+  uint64_t backward(const FrozenTrie& trie, uint32_t node, uint64_t from, uint64_t to, size_t len);
+
+  std::vector<uint64_t> _reach;   // 从ROOT出发能到达的结束位置
+  std::vector<uint64_t> _alive;   // 能到达且之后能匹配到串尾的结束位置
+  std::vector<DictHit> _hits;     // 按前向计算的顺序记录，收回时倒序消费
+  std::vector<std::pair<wchar_t, uint64_t>> _char_masks;  // 字符 => 出现位置的掩码，按字符排序
+};
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_MASK_ENGINE_H__
@@ -0,0 +1,33 @@
+#ifndef __OP_TRIE_MATCH_STATS_H__
+#define __OP_TRIE_MATCH_STATS_H__
+
+#include <cstdint>
+
+namespace optrie {
+
+// 单次匹配的执行统计，用于定位耗CPU的查询和模板
+// 编译时定义OPTRIE_MATCH_STATS才会统计（MatchResult::stats），否则计数代码不参与编译
+struct MatchStats {
+  uint64_t nodes_visited = 0;   // 展开的(节点, 起始位置)数
+  uint64_t memo_hits = 0;       // 因已确认失败而跳过的(节点, 起始位置)数
+  uint64_t iterator_steps = 0;  // MatchIterator::next的调用次数
+  uint64_t dict_probes = 0;     // 词典前缀树的查询次数（前缀遍历和整词查找）
+  uint64_t backtracks = 0;      // 子树匹配失败后退回的次数
+  uint64_t max_depth = 0;       // 匹配路径的最大深度
+};
+
+#ifdef OPTRIE_MATCH_STATS
+// 当前线程正在进行（或最近一次）的匹配的统计
+inline MatchStats& match_stats() {
+  static thread_local MatchStats stats;
+  return stats;
+}
+
+#define OPTRIE_STATS(stmt) stmt
+#else
+#define OPTRIE_STATS(stmt)
+#endif
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_MATCH_STATS_H__
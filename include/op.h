@@ -2,81 +2,55 @@
 #define __OP_TRIE_OP_H__
 
 #include <iostream>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 #include <cassert>
 
+#include "length_set.h"
 #include "utils.h"
 
 namespace optrie {
 
-static size_t MAX_LEN = 64;
+// 最大匹配长度，默认64，需要在构建树之前修改
+extern size_t MAX_LEN;
 
 void set_max_match_len(size_t len);
 
-class OpNode;
+struct FrozenNode;
+class FrozenTrieBuilder;
 
-// 每个节点的匹配结果
-struct OpResult {
-  OpResult(size_t start, size_t length, const OpNode* op)
-      : start(start), length(length), op(op) {}
-
-  size_t start;      // 字符串起始位置
-  size_t length;     // 匹配长度
-  const OpNode* op;  // 算子
-};
-
-// 每个节点的匹配结果
-class MatchIterator {
- public:
-  MatchIterator(const OpNode* node, const std::wstring& s, size_t pos_start,
-                size_t len_start, size_t len_end, int64_t len_step)
-      : _op(node), _s(s),
-        _pos_start(pos_start),
-        _len_start(static_cast<int64_t>(len_start)),
-        _len_end(static_cast<int64_t>(len_end)),
-        _len_step(len_step) {}
-
-  /**
-   * 迭代至下一个hit的结果
-   * Returns: 存在下一个匹配时返回true，否则返回false
-   * Params:
-   *    length: 存在下一个匹配时改为匹配的片段长度，否则不变
-   */
-  bool next(size_t& length);
-
-  // 打印（stdout）debug信息
-  void debug_info() const;
-
- private:
-  const OpNode* _op;  // 算子
-  std::wstring _s;    // 要匹配的字符串（TODO, 改指针，减少拷贝）
-
-  size_t _pos_start;   // 要匹配的起始位置
-  int64_t _len_start;  // 长度范围起始
-  int64_t _len_end;    // 长度范围结束
-  int64_t _len_step;   // 长度范围步长，±1
+// 终止于某个节点的模板
+// 规范化后等价的不同模板项（如[W:1][W:1]和[W:0-2]）共用终止节点，各占一项
+struct TemplateEntry {
+  std::string tpl;                            // 模板项
+  double score = 0.0;                         // 置信度
+  std::map<std::string, std::string> extra;   // 额外payload，如分类
+  std::map<std::string, size_t> extractors;   // 需要抽取的节点映射，{key: 子节点顺序（正序，对应于OpResult列表顺序）}
 };
 
 // 算子节点（基类）
+// 构建时使用，匹配前会冻结为FrozenTrie（见frozen_trie.h）
 class OpNode {
-  friend class MatchIterator;
-
  public:
   OpNode(const std::string& expr)
-      : expr(expr), tpl(""), score(0.0), is_end(false),
-        _parent(nullptr), _max_len(MAX_LEN), _min_len(0), _child_max_len(0), _child_min_len(0) {}
+      : expr(expr), score(0.0), is_end(false),
+        _parent(nullptr), _max_len(MAX_LEN), _min_len(0), _child_max_len(0), _child_min_len(1 << 20),
+        _child_lengths(MAX_LEN),
+        _subtree_max_score(-std::numeric_limits<double>::infinity()) {}
+
+  virtual ~OpNode() = default;
 
   /**
-   * 匹配，返回一个迭代器（w/ next方法）
-   * Returns: MatchIterator, 迭代器对象
+   * 冻结，把当前节点写成扁平布局的节点记录
+   * 基类填写长度范围、终止信息等公共字段，子类再填写算子类型和参数
    * Params:
-   *    s: std::wstring
-   *    start: 起始位置
+   *    node: 要填写的节点记录
+   *    builder: 冻结中的树，算子参数（字面字符、词典）写入其中
    */
-  virtual MatchIterator match(const std::wstring& s, size_t start) const = 0;
+  virtual void freeze(FrozenNode& node, FrozenTrieBuilder& builder) const;
 
   /**
    * 根据expr拿子节点
@@ -91,8 +65,16 @@ class OpNode {
   // 需要先确认同expr表达式的节点不存在
   void add_child(std::shared_ptr<OpNode> child);
 
+  // 删除子节点（保持其他子节点的顺序）
+  void remove_child(const std::string& expr);
+
+  // 父节点只是引用，不持有，避免父子之间循环引用
   inline void set_parent(std::shared_ptr<OpNode> parent) {
-    _parent = parent;
+    _parent = parent.get();
+  }
+
+  inline OpNode* parent() const {
+    return _parent;
   }
 
   // (向下)修正max_len
@@ -105,52 +87,64 @@ class OpNode {
     _min_len = max(_min_len, min_len);
   }
 
-  // 计算子树能匹配的长度范围，方便回溯匹配时做剪枝
-  void update_child_min_max_len();
+  // 依赖的外部数据（如词典）更新后，刷新节点信息，默认什么都不做
+  virtual void refresh() {}
 
-  // 判断剩余字符串长度能否塞进至少一个子树中
-  inline bool can_fit_in_children(size_t length) const {
-    return length >= _child_min_len && length <= _child_max_len;
-  }
+  // 当前节点能匹配的长度集合，默认是[min_len, max_len]内的所有长度
+  virtual LengthSet lengths() const;
 
-  inline const std::map<std::string, std::string>& get_extra() const {
-    return _extra;
-  }
+  // 计算子树能匹配的长度范围和精确的长度集合，方便回溯匹配时做剪枝
+  // recursive为false时认为子节点已经算好，只更新当前节点（增删模板时沿路径向上更新）
+  void update_child_min_max_len(bool recursive = true);
 
-  inline void set_extra(const std::map<std::string, std::string>& extra) {
-    _extra = extra;
-  }
+  // 子节点child（为空时只看自身是否可终止）的长度信息变大后，并入当前节点
+  // 增加模板时长度集合只会变大，不用遍历所有子节点
+  void merge_child_min_max_len(const OpNode* child);
 
-  inline const std::map<std::string, size_t>& get_extractors() const {
-    return _extractors;
+  // 计算子树（含自身）中可终止节点的最高分，方便最高分匹配时剪枝
+  // recursive含义同上
+  void update_subtree_max_score(bool recursive = true);
+
+  inline double subtree_max_score() const {
+    return _subtree_max_score;
   }
 
-  inline void set_extractors(const std::map<std::string, size_t>& extractors) {
-    _extractors = extractors;
+  /**
+   * 在当前节点上终止一个模板，同一模板项覆盖原来的，不同模板项追加在后面
+   * Returns: 覆盖之前已经终止于当前节点的其他模板项（规范化后等价），没有时为空
+   */
+  std::vector<std::string> set_template(const TemplateEntry& entry);
+
+  /**
+   * 去掉模板项为tpl的模板，其他模板不变
+   * Returns: 是否存在
+   */
+  bool erase_template(const std::string& tpl);
+
+  inline const std::vector<TemplateEntry>& templates() const {
+    return _templates;
   }
 
   // 级联显示当前节点及子孙节点的信息
   void show(size_t depth = 0) const;
 
   std::string expr;                               // 表达式
-  std::string tpl;                                // 叶子节点对应的模板
-  double score;                                   // 置信度
-  bool is_end;                                    // 是否可以终止匹配
+  double score;                                   // 置信度（终止于当前节点的模板的最高分）
+  bool is_end;                                    // 是否可以终止匹配（有模板终止于当前节点）
   std::vector<std::shared_ptr<OpNode>> children;  // 子节点
 
  protected:
-  virtual bool match_next(const std::wstring& s, size_t start, size_t length) const = 0;
-
-  std::shared_ptr<OpNode> _parent;                               // 父节点
+  OpNode* _parent;                                               // 父节点
   std::map<std::string, std::shared_ptr<OpNode>> _children_map;  // 子节点map，方便构建时查询
 
   size_t _max_len;        // 当前节点支持的最大长度
   size_t _min_len;        // 当前节点支持的最小长度
   size_t _child_max_len;  // 当前节点子树支持的最大长度
   size_t _child_min_len;  // 当前节点子树支持的最小长度
+  LengthSet _child_lengths;  // 当前节点子树能匹配的精确长度集合（不超过MAX_LEN）
+  double _subtree_max_score;  // 子树（含自身）中可终止节点的最高分
 
-  std::map<std::string, std::string> _extra;   // 每个模板的额外payload，如分类
-  std::map<std::string, size_t> _extractors;  // 需要抽取的节点映射，{key: 子节点顺序（正序，对应于OpResult列表顺序）}
+  std::vector<TemplateEntry> _templates;  // 终止于当前节点的模板，按加入的先后（首个匹配取第一项）
 };
 
 // ROOT节点（不做匹配）
@@ -161,18 +155,12 @@ class RootOpNode : public OpNode {
   }
   ~RootOpNode() {}
 
-  virtual MatchIterator match(const std::wstring& s, size_t start) const {
-    throw std::runtime_error("U SHOULD NOT BE HERE!");
-  }
+  virtual void freeze(FrozenNode& node, FrozenTrieBuilder& builder) const;
 
  private:
   inline void init() {
     set_max_len(0);
   }
-
-  virtual bool match_next(const std::wstring& s, size_t start, size_t end) const {
-    return false;
-  }
 };
 
 }  // namespace optrie
@@ -2,9 +2,20 @@
 #define __OP_TRIE_OP_TRIE_H__
 
 #include "op.h"
+#include "frozen_trie.h"
 #include "dict_op.h"
 #include "literal_op.h"
+#include "anchor_op.h"
 #include "wildcard_op.h"
+#include "mask_engine.h"
+#include "match_stats.h"
+#include "rcu.h"
+#include "template_cost.h"
+#include "template_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 
 namespace optrie {
 
@@ -17,7 +28,8 @@ class OpNodeFactory {
    * 工厂方法，根据expr构造算子节点，支持一下几种expr
    * 1. [D:dict_name] -> 词典算子
    * 2. [W:min-max] -> 模糊匹配，min可省略，默认为0
-   * 3. 其他 -> 明文（完全）匹配
+   * 3. [^] / [$] -> 串首/串尾锚点（只能在模板开头/结尾）
+   * 4. 其他 -> 明文（完全）匹配
    */
   std::shared_ptr<OpNode> get(const std::string& expr);
 
@@ -36,17 +48,212 @@ struct MatchResult {
   std::map<std::string, std::string> extra;
   // 匹配的模板
   std::string tpl;
+  // 匹配的区间[start, end)，整串匹配时为整个串，子串搜索时为出现的位置
+  size_t start = 0;
+  size_t end = 0;
+  // 是否因超出预算（MatchBudget）提前结束，此时结果为结束前找到的（首个匹配模式下为未匹配）
+  bool timed_out = false;
+#ifdef OPTRIE_MATCH_STATS
+  // 产生该结果的这次调用的执行统计（不论是否匹配都有）
+  MatchStats stats;
+#endif
+};
+
+// explain中尝试的一个子节点
+struct ExplainCandidate {
+  uint32_t node;                // 节点下标
+  std::string expr;             // 节点表达式
+  std::vector<size_t> lengths;  // 匹配迭代器依次给出的长度，为空表示在该位置匹配不上
+};
+
+// explain中的一次展开：node匹配了[start, start + length)，再从start + length尝试它的子节点
+struct ExplainStep {
+  int64_t parent = -1;          // 父步骤的下标，ROOT为-1
+  uint32_t node = 0;            // 节点下标
+  std::string expr;             // 节点表达式
+  std::string tpl;              // 可终止节点对应的模板，否则为空
+  size_t depth = 0;             // 在匹配路径上的深度，ROOT为0
+  size_t start = 0;             // 节点匹配的起始位置
+  size_t length = 0;            // 节点匹配的长度
+  bool memo_hit = false;        // (节点, 结束位置)之前已确认失败，直接跳过
+  bool accepted = false;        // 可终止且正好匹配到串尾，匹配结束
+  bool fits_children = false;   // 剩余长度能否被子树匹配，不能时不再尝试子节点（跳过或结束的步骤不判断）
+  bool backtracked = false;     // 子树没有匹配成功，退回父节点尝试下一个候选
+  std::vector<ExplainCandidate> candidates;  // 依次尝试的子节点
+  uint64_t cost = 0;            // 子树（含自身）中的展开次数
+};
+
+// explain的结果
+struct ExplainResult {
+  MatchResult result;              // 匹配结果，同match
+  std::vector<ExplainStep> steps;  // 按展开的先后（先序），steps[0]为ROOT，其cost为总开销
+};
+
+// 单次匹配的预算，用完后停止回溯，用于限制个别串的耗时
+struct MatchBudget {
+  uint64_t max_steps = 0;    // 最多展开的(节点, 起始位置)数，0表示不限
+  uint64_t deadline_us = 0;  // 最长耗时（微秒，从开始匹配算起），0表示不限
+
+  inline bool unlimited() const {
+    return max_steps == 0 && deadline_us == 0;
+  }
+};
+
+// 解析好的一行模板
+struct ParsedTemplate {
+  std::string tpl;                                // 模板项（第一列）
+  std::vector<std::string> exprs;                 // 节点表达式
+  double score = 0.0;                             // 置信度
+  std::map<std::string, std::string> extra;       // 额外payload
+  std::map<std::string, size_t> extractors;       // 需要抽取的节点映射
+};
+
+// 单次匹配内的失败记忆：记录已确认无法匹配成功的(节点, 起始位置)
+// 按 node_id * (len + 1) + pos 索引的位图，只清理用过的字，避免每次整体清零
+class FailMemo {
+ public:
+  // 开始新一次匹配
+  inline void reset(size_t num_nodes, size_t len) {
+    for (auto w : _dirty) {
+      _bits[w] = 0;
+    }
+    _dirty.clear();
+    _stride = len + 1;
+    size_t num_words = (num_nodes * _stride + 63) / 64;
+    if (_bits.size() < num_words) {
+      _bits.resize(num_words, 0);
+    }
+  }
+
+  inline bool test(size_t node_id, size_t pos) const {
+    size_t i = node_id * _stride + pos;
+    return (_bits[i >> 6] >> (i & 63)) & 1;
+  }
+
+  inline void set(size_t node_id, size_t pos) {
+    size_t i = node_id * _stride + pos;
+    auto& word = _bits[i >> 6];
+    if (word == 0) {
+      _dirty.emplace_back(i >> 6);
+    }
+    word |= uint64_t(1) << (i & 63);
+  }
+
+  // match_dfs用的记忆接口：展开前enter，到达可终止节点时hit，展开完leave
+  // 整串匹配的memo只记展开过的(节点, 位置)，不区分子树有没有结果
+  inline size_t enter() const {
+    return 0;
+  }
+
+  inline void hit() {}
+
+  inline void leave(size_t node_id, size_t pos, size_t /* mark */) {
+    set(node_id, pos);
+  }
+
+ private:
+  size_t _stride = 1;
+  std::vector<uint64_t> _bits;   // 位图
+  std::vector<size_t> _dirty;    // 被置位过的字下标
+};
+
+// 子串搜索的记忆，所有起始位置共用：
+//   dead: 子树里没有可终止节点的(节点, 位置)，和起始位置无关，整次搜索都有效
+//   live: 当前起始位置下展开过、子树有出现的(节点, 位置)，再次到达时跳过（出现已记过），换起始位置时清空
+// 从begin出发只会到达[begin, begin + window)内的位置，按 pos % window 分行、每行按字对齐，
+// 内存只和树的大小、模板的最大跨度有关，和文本长度无关
+class SearchMemo {
+ public:
+  // 开始新一次搜索
+  inline void reset(size_t num_nodes, size_t window) {
+    std::fill(_dead.begin(), _dead.begin() + _row_words * _window, 0);
+    clear(_live, _live_dirty);
+    _window = window;
+    _row_words = (num_nodes + 63) / 64;
+    size_t num_words = _row_words * _window;
+    if (_dead.size() < num_words) {
+      _dead.resize(num_words, 0);
+      _live.resize(num_words, 0);
+    }
+    _hits = 0;
+  }
+
+  // 起始位置移到begin：begin - 1所在的行要留给新进入窗口的位置，清掉；live只对一个起始位置有效，清空
+  inline void advance(size_t begin) {
+    if (begin > 0) {
+      size_t row = (begin - 1) % _window;
+      std::fill(_dead.begin() + row * _row_words, _dead.begin() + (row + 1) * _row_words, 0);
+    }
+    clear(_live, _live_dirty);
+  }
+
+  // 到达过的(节点, 位置)；跳过live的时也算子树有出现
+  inline bool test(size_t node_id, size_t pos) {
+    size_t i = index(node_id, pos);
+    uint64_t bit = uint64_t(1) << (node_id & 63);
+    if (_live[i] & bit) {
+      ++_hits;
+      return true;
+    }
+    return _dead[i] & bit;
+  }
+
+  inline size_t enter() const {
+    return _hits;
+  }
+
+  inline void hit() {
+    ++_hits;
+  }
+
+  // 展开以来没有出现时记为dead
+  inline void leave(size_t node_id, size_t pos, size_t mark) {
+    size_t i = index(node_id, pos);
+    uint64_t bit = uint64_t(1) << (node_id & 63);
+    if (_hits == mark) {
+      _dead[i] |= bit;
+    } else {
+      if (_live[i] == 0) {
+        _live_dirty.emplace_back(i);
+      }
+      _live[i] |= bit;
+    }
+  }
+
+ private:
+  inline size_t index(size_t node_id, size_t pos) const {
+    return pos % _window * _row_words + (node_id >> 6);
+  }
+
+  static inline void clear(std::vector<uint64_t>& bits, std::vector<size_t>& dirty) {
+    for (auto w : dirty) {
+      bits[w] = 0;
+    }
+    dirty.clear();
+  }
+
+  size_t _window = 1;
+  size_t _row_words = 0;
+  std::vector<uint64_t> _dead;       // advance按行清理，reset时整体清理
+  std::vector<uint64_t> _live;
+  std::vector<size_t> _live_dirty;
+  size_t _hits = 0;                  // 到达可终止节点（含跳过live）的次数
 };
 
 // 算子匹配树
 class OpTrie {
  public:
-  OpTrie() : _root(std::make_shared<RootOpNode>()), _pat_dic(std::make_shared<PatternDict>()) {}
+  OpTrie() : _root(std::make_shared<RootOpNode>()), _pat_dic(std::make_shared<PatternDict>()),
+             _frozen(nullptr) {
+    freeze();
+  }
 
   ~OpTrie() = default;
 
   /**
-   * 初始化，加载模板和词典
+   * 初始化，加载模板和词典，也可以用load([], [要更新的词典])热更新词典
+   * 新的树在旁边构建好后原子地替换，匹配线程不会阻塞，也不会看到加载了一半的词典；
+   * 旧的树等正在用它的匹配结束后释放。多次load之间串行执行
    * Params:
    *    template_files: 模板文件
    *    dict_files: 词典算子用到的词典文件
@@ -54,35 +261,269 @@ class OpTrie {
   OpTrie& load(const std::vector<std::string>& template_files,
                const std::vector<std::string>& dict_files);
 
+  /**
+   * 从内存加载，不读文件，语义同load（词典并入已有词典，模板追加到已有模板之后）
+   * Params:
+   *    template_lines: 模板行，格式同模板文件中的一行，空行和#开头的行跳过
+   *    dicts: {词典名: 词列表}，词典名同词典文件中的[D:xxx]，也可以只写xxx
+   */
+  OpTrie& load_from_memory(const std::vector<std::string>& template_lines,
+                           const std::map<std::string, std::vector<std::string>>& dicts);
+
+  /**
+   * 从内存加载，参数分别为模板文件和词典文件的内容（UTF-8文本）
+   * 用于从配置中心等处拿到整个文件内容的场景，省去写临时文件再读回来
+   */
+  OpTrie& load_from_text(std::string_view template_text, std::string_view dict_text);
+
+  /**
+   * 增加一个模板，格式同模板文件中的一行（tab分隔），模板项已存在时覆盖其信息
+   * 只把新节点接入树中并沿路径更新剪枝信息，不重新加载文件和词典，之后发布新的快照
+   * Params:
+   *    line: 模板行
+   */
+  OpTrie& add_template(const std::string& line);
+
+  // 批量增加模板，只发布一次快照；任何一行格式不对时抛异常，不修改树
+  OpTrie& add_templates(const std::vector<std::string>& lines);
+
+  /**
+   * 删除一个模板，剪掉不再有模板经过的分支并沿路径更新剪枝信息，之后发布新的快照
+   * Returns: 模板是否存在
+   * Params:
+   *    tpl: 模板项（模板行的第一列）
+   */
+  bool remove_template(const std::string& tpl);
+
+  // 批量删除模板，只发布一次快照，返回实际删除的个数
+  size_t remove_templates(const std::vector<std::string>& tpls);
+
   /**
    * 模板匹配
    * Returns: bool, 是否匹配成功
    * Params:
-   *    s: std::wstring
-   *    extra: {k: v}
-   *    groups: {k: matched value}
+   *    s: 要匹配的字符串（只读视图，匹配过程不拷贝）
+   */
+  MatchResult match(std::wstring_view s) const;
+
+  /**
+   * 带预算的模板匹配，步数或时间用完时停止，返回未匹配且MatchResult::timed_out为true
+   * 预算内能完成时结果和不带预算的match一致
+   * Params:
+   *    s: 要匹配的字符串
+   *    budget: 预算
+   */
+  MatchResult match(std::wstring_view s, const MatchBudget& budget) const;
+
+  /**
+   * 批量模板匹配，多线程执行，结果与输入顺序一致
+   * Params:
+   *    strs: 要匹配的字符串列表
+   *    num_threads: 线程数，0表示使用CPU核数
+   *    budget: 每个串各自的预算，默认不限
+   */
+  std::vector<MatchResult> match_batch(const std::vector<std::wstring>& strs,
+                                       size_t num_threads = 0,
+                                       const MatchBudget& budget = MatchBudget()) const;
+
+  /**
+   * 最高分模板匹配，多个模板匹配时返回score最大的（同分取先找到的）
+   * 用每个子树的最高分剪枝，不可能超过当前最优的子树不再展开
+   * Params:
+   *    s: 要匹配的字符串
    */
-  MatchResult match(const std::wstring& s) const;
+  MatchResult match_best(std::wstring_view s) const;
 
-  // 显示树结构，及一些辅助信息
+  // 带预算的最高分匹配，预算用完时返回已找到的最高分模板（可能不是全局最高），timed_out为true
+  MatchResult match_best(std::wstring_view s, const MatchBudget& budget) const;
+
+  /**
+   * 返回所有匹配的模板（一次遍历），按找到的先后排序，每个模板只出现一次
+   * Params:
+   *    s: 要匹配的字符串
+   */
+  std::vector<MatchResult> match_all(std::wstring_view s) const;
+
+  /**
+   * 返回score最高的k个匹配模板，按score降序（同分按找到的先后）
+   * 遍历时维护大小为k的堆，子树最高分不超过堆中最低分时剪掉
+   * Params:
+   *    s: 要匹配的字符串
+   *    k: 最多返回的模板数
+   */
+  std::vector<MatchResult> match_topk(std::wstring_view s, size_t k) const;
+
+  /**
+   * 子串搜索，一次扫描返回模板在s中的所有出现
+   * 按起始位置排序，同一起始位置按找到的先后；MatchResult::start/end为出现的区间
+   * 模板首尾的 [^] / [$] 表示必须出现在串首/串尾
+   * Params:
+   *    s: 要搜索的文本，不受最大匹配长度限制
+   */
+  std::vector<MatchResult> search(std::wstring_view s) const;
+
+  /**
+   * 解释一次首个匹配的过程：每次展开的节点、各子节点给出的候选长度、
+   * 剩余长度放不进子树的剪枝、回溯的位置，以及每个子树的展开次数
+   * 单独的实现，和match的结果一致（始终按DFS），不影响match的性能；开销较大，只用于排查
+   * Params:
+   *    s: 要匹配的字符串
+   */
+  ExplainResult explain(std::wstring_view s) const;
+
+  /**
+   * 选择整串匹配（match/match_batch/match_best/match_all/match_topk）使用的引擎，结果与DFS完全一致
+   * 需要在匹配前设置，不能和匹配并发调用；子串搜索始终使用DFS
+   * Params:
+   *    engine: 见MatchEngine
+   */
+  OpTrie& set_engine(MatchEngine engine);
+
+  inline MatchEngine engine() const {
+    return _engine;
+  }
+
+  /**
+   * 把当前的冻结树（含用到的词典）写成二进制镜像文件
+   * 镜像带版本号，内部只用偏移，和加载地址无关，同一平台上可以直接映射使用
+   * Params:
+   *    path: 镜像文件路径
+   */
+  void save(const std::string& path) const;
+
+  /**
+   * 映射save生成的镜像文件，直接在映射的页面上匹配，不做反序列化
+   * 打开后只能匹配，不能再load或增删模板；可以再次open其他镜像（原子替换）
+   * Params:
+   *    path: 镜像文件路径
+   */
+  OpTrie& open(const std::string& path);
+
+  /**
+   * 把当前的冻结树移到匿名共享内存（只读），并释放构建用的OpNode树和词典
+   * 用于预先加载再fork的多进程服务（如gunicorn的preload_app）：在主进程load之后调用，
+   * 子进程继承同一段映射，匹配只读这些页，不会触发写时复制，内存不随进程数增长
+   * 之后只能匹配，不能再load或增删模板
+   */
+  OpTrie& share();
+
+  /**
+   * 静态分析当前模板的最坏回溯开销（见TemplateCost），按cost降序
+   * 用于上线前找出相邻模糊匹配等会导致回溯爆炸的模板
+   * Params:
+   *    top_k: 只返回开销最大的k个，0表示全部
+   */
+  std::vector<TemplateCost> analyze(size_t top_k = 20) const;
+
+  /**
+   * 静态分析各子树的最坏回溯开销（见SubtreeCost），按cost降序，用于找出兄弟多而宽、拖慢所有后代模板的节点
+   * Params:
+   *    top_k: 只返回开销最大的k个，0表示全部
+   */
+  std::vector<SubtreeCost> analyze_subtrees(size_t top_k = 20) const;
+
+  /**
+   * 设置模板开销（TemplateCost::cost）的上限，之后每次加载、增删模板时，超过上限的模板（包括已有的）
+   * 在发布前从树中删掉并打印警告；词典热更新后词长变化导致超限的模板也会被删掉
+   * Params:
+   *    max_cost: 上限，0表示不限（默认）
+   */
+  OpTrie& set_max_template_cost(double max_cost);
+
+  /**
+   * 开启/关闭按模板的统计：到达每个模板终止节点的次数、匹配成功的次数、在其子树内的耗时
+   * 每个匹配线程写自己的分片，不会让匹配线程互相等待；关闭时匹配只多一次判断
+   * Params:
+   *    enabled: 是否开启
+   */
+  OpTrie& set_template_stats(bool enabled);
+
+  /**
+   * 按模板的统计（自上次reset以来），按模板项排序
+   * 包含当前所有模板（没有到达过的计数为0），以及统计期间删除、但有过计数的模板
+   */
+  std::vector<TemplateStat> template_stats() const;
+
+  // 清零按模板的统计
+  void reset_template_stats();
+
+  // 显示树结构，及一些辅助信息（和load串行）
   void show() const;
 
  private:
   std::shared_ptr<RootOpNode> _root;      // 根节点（不做匹配）
   std::shared_ptr<PatternDict> _pat_dic;  // 词典匹配算子的词典
+  std::map<std::string, OpNode*> _ends;   // 模板项 -> 终止节点（规范化后的路径还取决于抽取项，不能靠重新解析模板项找到）
+  RcuCell<FrozenTrie> _frozen;            // 冻结的树（当前快照），匹配都在它上面进行
+  mutable std::mutex _write_mutex;        // 串行化load等修改操作，匹配不用
+  MatchEngine _engine = MatchEngine::DFS; // 整串匹配使用的引擎
+  bool _read_only = false;                // 是否由镜像打开或已共享（没有OpNode树，不能修改）
+  double _max_template_cost = 0;          // 模板开销上限，0表示不限
+  std::atomic<bool> _template_stats{false};                      // 是否开启按模板的统计
+  mutable std::mutex _stats_mutex;                               // 保护_retired_stats，串行化汇总和快照替换
+  std::map<std::string, TemplateCount> _retired_stats;           // 已替换的快照上的计数，按模板项累计
+
+  // 由镜像打开时，修改操作抛异常
+  void check_writable() const;
 
   // 加载词典匹配算子的词典
   void load_pat_dict(const std::vector<std::string>& dict_files);
 
+  // 词典更新后，刷新已有节点的词长信息
+  void refresh_nodes();
+
   // 加载模板，构建树
   void load_templates(const std::vector<std::string>& template_files);
 
+  // 并行解析模板行，再按顺序接入树中，格式不对的行跳过
+  void insert_template_lines(const std::vector<std::string>& lines);
+
+  // 把解析好的模板接入树中，返回模板的终止节点
+  OpNode* insert_template(const ParsedTemplate& parsed);
+
+  // 删除模板（不加锁、不冻结），返回实际删除的个数
+  size_t erase_templates(const std::vector<std::string>& tpls);
+
+  // 去掉终止节点上模板项为tpl的模板，剪掉不再有模板经过的分支，并更新路径（不维护_ends）
+  void erase_end(OpNode* op, const std::string& tpl);
+
+  // 从op沿父节点到ROOT，依次更新子树长度范围和最高分（子节点已是最新）
+  // grow为true时（增加模板）长度信息只会变大，只并入路径上的子节点
+  void update_path(OpNode* op, bool grow);
+
   // 优化剪枝
   void optimize();
 
-  // 回溯匹配（递归调用）
-  bool match_dfs(std::shared_ptr<OpNode> cur_node, const std::wstring& s, size_t start,
-                 std::vector<OpResult>& matched_results) const;
+  // 把OpNode树冻结为扁平布局并发布为新的快照，之后的匹配只按下标访问节点
+  // 设置了开销上限时，先删掉超限的模板再发布
+  void freeze();
+
+  // 把OpNode树冻结为扁平布局
+  std::unique_ptr<FrozenTrie> build_frozen() const;
+
+  // 发布新的快照，旧快照上的模板计数并入_retired_stats
+  void publish(std::unique_ptr<const FrozenTrie> trie);
+
+  // 开启模板统计时返回当前线程在trie上的计数分片，否则为空
+  TemplateCounters::Counter* template_counters(const FrozenTrie& trie) const;
+
+  // 在指定快照上做首个匹配
+  MatchResult match(const FrozenTrie& trie, std::wstring_view s, const MatchBudget& budget) const;
+
+  // 整串匹配，按当前引擎从ROOT开始回溯，matched_results为匹配路径
+  template <class Collector>
+  void match_to_end(const FrozenTrie& trie, std::wstring_view s,
+                    std::vector<OpResult>& matched_results, Collector& collector) const;
+
+  // 回溯匹配（递归调用），collector决定到达可终止节点后是否结束、哪些子树可以剪掉，预算用完时也结束
+  // 同一(节点, 起始位置)展开过后记入memo（FailMemo或SearchMemo），之后经其他路径到达时直接跳过
+  // guide不为空时（位并行引擎），只展开之后能匹配到串尾的(节点, 位置)
+  // kTemplateStats为true时（开启模板统计），在counters中记录到达的终止节点
+  template <class Collector, bool kTemplateStats = false, class Memo = FailMemo>
+  bool match_dfs(const FrozenTrie& trie, uint32_t node_id, std::wstring_view s, size_t start,
+                 std::vector<OpResult>& matched_results, Memo& memo,
+                 Collector& collector, const MaskEngine* guide,
+                 TemplateCounters::Counter* counters) const;
 };
 
 }  // namespace optrie
@@ -0,0 +1,86 @@
+#ifndef __OP_TRIE_RCU_H__
+#define __OP_TRIE_RCU_H__
+
+#include <atomic>
+#include <memory>
+
+namespace optrie {
+
+// 简单的RCU（epoch方式）：读者不加锁、不阻塞，写者发布新值后等所有可能还在读旧值的读者离开，再释放旧值
+// 所有RcuCell共用一个全局epoch和读者登记表，每个线程一个登记槽，首次读时无锁登记，线程退出后槽可复用
+
+// 进入读临界区，可嵌套
+void rcu_read_lock();
+
+// 离开读临界区
+void rcu_read_unlock();
+
+// 等待调用之前已进入读临界区的读者全部离开（不能在读临界区内调用）
+void rcu_synchronize();
+
+// 读多写少的共享值，读者拿到的始终是某个完整发布过的版本
+template <class T>
+class RcuCell {
+ public:
+  // 读guard，存活期间拿到的值不会被释放
+  class ReadGuard {
+   public:
+    explicit ReadGuard(const RcuCell& cell) {
+      rcu_read_lock();
+      _value = cell._value.load(std::memory_order_seq_cst);
+    }
+
+    ~ReadGuard() {
+      rcu_read_unlock();
+    }
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+
+    inline const T& operator*() const {
+      return *_value;
+    }
+
+    inline const T* operator->() const {
+      return _value;
+    }
+
+    // 尚未发布过值时为空
+    inline const T* get() const {
+      return _value;
+    }
+
+   private:
+    const T* _value;
+  };
+
+  explicit RcuCell(std::unique_ptr<const T> value) : _value(value.release()) {}
+
+  ~RcuCell() {
+    delete _value.load();
+  }
+
+  RcuCell(const RcuCell&) = delete;
+  RcuCell& operator=(const RcuCell&) = delete;
+
+  inline ReadGuard read() const {
+    return ReadGuard(*this);
+  }
+
+  /**
+   * 发布新值，等读者离开后释放旧值
+   * 多个写者之间需要调用方自行串行
+   */
+  void publish(std::unique_ptr<const T> value) {
+    const T* old = _value.exchange(value.release(), std::memory_order_seq_cst);
+    rcu_synchronize();
+    delete old;
+  }
+
+ private:
+  std::atomic<const T*> _value;
+};
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_RCU_H__
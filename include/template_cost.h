@@ -0,0 +1,46 @@
+#ifndef __OP_TRIE_TEMPLATE_COST_H__
+#define __OP_TRIE_TEMPLATE_COST_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frozen_trie.h"
+
+namespace optrie {
+
+// 模板的静态开销估计（只看树结构和长度信息，不依赖查询）
+struct TemplateCost {
+  std::string tpl;             // 模板项
+  double branching = 1;        // 路径上各节点候选长度数之积：不剪枝、不记忆时一个串最多尝试的切分数
+  double cost = 0;             // 最坏情况下匹配到该模板要产生的候选数：路径上每个节点在各可达位置上尝试全部子节点
+                               // （含兄弟，有分派表时按首字符最多的一格算）给出的候选长度之和，
+                               // 可达位置数受记忆（同一节点同一位置只展开一次）限制
+  uint32_t variable_run = 0;   // 路径上连续的可变长节点（模糊匹配、有多种词长的词典）最多有几个
+};
+
+// 子树的静态开销估计
+struct SubtreeCost {
+  std::string prefix;          // ROOT到子树根的节点表达式，ROOT为空串
+  double cost = 0;             // 最坏情况下整棵子树产生的候选数（口径同TemplateCost::cost）
+  uint32_t num_children = 0;   // 子树根的子节点数
+};
+
+/**
+ * 估计冻结树上每个模板的最坏回溯开销，结果按模板下标
+ * 相邻的可变长节点（如[W:0-5][W:0-5][D:x]）会让切分数相乘，是回溯耗时高的主要原因
+ * Params:
+ *    trie: 冻结的树
+ */
+std::vector<TemplateCost> analyze_templates(const FrozenTrie& trie);
+
+/**
+ * 估计冻结树上每棵子树（有子节点的节点）的最坏回溯开销，子节点多而宽的节点会拖慢经过它的所有模板
+ * Params:
+ *    trie: 冻结的树
+ */
+std::vector<SubtreeCost> analyze_subtrees(const FrozenTrie& trie);
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_TEMPLATE_COST_H__
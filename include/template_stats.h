@@ -0,0 +1,87 @@
+#ifndef __OP_TRIE_TEMPLATE_STATS_H__
+#define __OP_TRIE_TEMPLATE_STATS_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace optrie {
+
+// 模板的累计计数
+struct TemplateCount {
+  uint64_t attempts = 0;  // 匹配时到达模板终止节点的次数
+  uint64_t hits = 0;      // 到达终止节点时匹配成功的次数（整串匹配时恰好到串尾，子串搜索时为一次出现）
+  uint64_t time_ns = 0;   // 在终止节点的子树内花费的时间（纳秒，含子树中更长的模板）
+
+  inline TemplateCount& operator+=(const TemplateCount& other) {
+    attempts += other.attempts;
+    hits += other.hits;
+    time_ns += other.time_ns;
+    return *this;
+  }
+};
+
+// 单个模板的统计
+struct TemplateStat {
+  std::string tpl;  // 模板项
+  TemplateCount count;
+};
+
+/**
+ * 一个冻结树上按模板下标的计数
+ * 每个匹配线程一个分片，只由所属线程写（不用原子加），匹配线程之间不争用同一份计数；
+ * 汇总时累加各分片，reset只记下当前值作为基线，不写分片
+ */
+class TemplateCounters {
+ public:
+  // 分片中的计数，所属线程写，汇总时其他线程读
+  struct Counter {
+    std::atomic<uint64_t> attempts{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> time_ns{0};
+  };
+
+  // 单写者累加
+  static inline void add(std::atomic<uint64_t>& c, uint64_t v) {
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  explicit TemplateCounters(size_t num_templates);
+
+  TemplateCounters(const TemplateCounters&) = delete;
+  TemplateCounters& operator=(const TemplateCounters&) = delete;
+
+  // 当前线程的分片（按模板下标），首次调用时分配
+  Counter* shard();
+
+  // 是否有线程计过数
+  bool active() const;
+
+  // 汇总各分片，减去基线，结果按模板下标
+  std::vector<TemplateCount> collect() const;
+
+  // 以当前的汇总值为基线，之后collect从0开始
+  void reset();
+
+ private:
+  struct Shard {
+    std::thread::id owner;
+    std::unique_ptr<Counter[]> counters;
+  };
+
+  std::vector<TemplateCount> sum() const;
+
+  size_t _num_templates;
+  uint64_t _id;                         // 全局唯一，线程缓存分片时用，不随地址复用
+  mutable std::mutex _mutex;            // 保护分片列表和基线
+  std::vector<Shard> _shards;
+  std::vector<TemplateCount> _baseline;
+};
+
+}  // namespace optrie
+
+#endif  // __OP_TRIE_TEMPLATE_STATS_H__
@@ -1,7 +1,11 @@
 #ifndef __OP_TRIE_UTILS_H__
 #define __OP_TRIE_UTILS_H__
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 
@@ -13,6 +17,12 @@ size_t min(size_t x, size_t y);
 
 size_t relu(int64_t x);
 
+// 最高位1的下标，x不能为0
+size_t highest_bit(uint64_t x);
+
+// 最低位1的下标，x不能为0
+size_t lowest_bit(uint64_t x);
+
 void split(const std::string& str, char sep, std::vector<std::string>& result);
 
 std::string ltrim(const std::string& str);
@@ -21,14 +31,70 @@ std::string rtrim(const std::string& str);
 
 std::string trim(const std::string& str);
 
-std::wstring utf8_to_wstring(const std::string& str);
+// 同trim，但只返回视图，不拷贝
+std::string_view trim_view(std::string_view str);
+
+// 多线程可以同时调用（每个线程一个转换器）
+std::wstring utf8_to_wstring(std::string_view str);
 
 std::string wstring_to_utf8(const std::wstring& str);
 
-std::wstring to_lower(const std::wstring& str);
+std::wstring to_lower(std::wstring str);
+
+// 读入整个文件，打开失败时返回false
+bool read_file(const std::string& path, std::string& content);
+
+// 把文本在行边界处切成若干段，每段约chunk_size字节（至少一行），按原顺序排列
+void split_chunks(std::string_view text, size_t chunk_size, std::vector<std::string_view>& chunks);
+
+/**
+ * 多线程执行task(0), task(1), ..., task(num_tasks - 1)，当前线程也参与
+ * 其他线程来自进程内常驻的线程池（按需增加、多次调用间复用），不为每次调用创建线程
+ * 任务按下标从小到大领取，某个任务抛异常后不再领取新任务，全部线程结束后重新抛出第一个异常
+ * Params:
+ *    num_threads: 线程数，0表示使用CPU核数
+ */
+void parallel_for(size_t num_tasks, const std::function<void(size_t)>& task, size_t num_threads = 0);
 
 void replace_all(std::string& s, const std::string& from, const std::string& to);
 
+// 连续数组的只读视图，不持有内存（数据可以在堆上，也可以在映射的文件里）
+template <class T>
+class ArrayView {
+ public:
+  ArrayView() : _data(nullptr), _size(0) {}
+  ArrayView(const T* data, size_t size) : _data(data), _size(size) {}
+  ArrayView(const std::vector<T>& vec) : _data(vec.data()), _size(vec.size()) {}
+
+  inline const T& operator[](size_t i) const {
+    return _data[i];
+  }
+
+  inline const T* data() const {
+    return _data;
+  }
+
+  inline size_t size() const {
+    return _size;
+  }
+
+  inline bool empty() const {
+    return _size == 0;
+  }
+
+  inline const T* begin() const {
+    return _data;
+  }
+
+  inline const T* end() const {
+    return _data + _size;
+  }
+
+ private:
+  const T* _data;
+  size_t _size;
+};
+
 }
 
 
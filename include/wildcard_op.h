@@ -12,13 +12,16 @@ class WildcardOpNode : public OpNode {
     init();
   }
 
-  virtual MatchIterator match(const std::wstring& s, size_t start) const;
+  virtual void freeze(FrozenNode& node, FrozenTrieBuilder& builder) const;
 
- private:
-  void init();
+  // 解析表达式的长度范围，格式不对时抛异常
+  static void parse_range(const std::string& expr, size_t& min_len, size_t& max_len);
 
-  bool match_next(const std::wstring& s, size_t start, size_t length) const;
+  // 长度范围的规范写法[W:min-max]
+  static std::string canonical_expr(size_t min_len, size_t max_len);
 
+ private:
+  void init();
 };
 
 }  // namespace optrie
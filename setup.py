@@ -1,4 +1,6 @@
+import os
 import pathlib
+import sys
 from glob import glob
 from setuptools import setup
 from pybind11.setup_helpers import Pybind11Extension
@@ -11,7 +13,12 @@ ext_modules = [
         MODULE_NAME,
         glob('src/*.cpp'),
         include_dirs=['include'],
-        cxx_std=11,
+        cxx_std=17,
+        # match_batch用到std::thread
+        extra_compile_args=[] if sys.platform == 'win32' else ['-pthread'],
+        extra_link_args=[] if sys.platform == 'win32' else ['-pthread'],
+        # OPTRIE_MATCH_STATS=1 python setup.py install 编译出带执行统计的版本（MatchResult.stats）
+        define_macros=[('OPTRIE_MATCH_STATS', '1')] if os.environ.get('OPTRIE_MATCH_STATS') else [],
     ),
 ]
 
@@ -0,0 +1,23 @@
+#include "anchor_op.h"
+#include "frozen_trie.h"
+
+namespace optrie {
+
+void AnchorOpNode::init() {
+  if (expr == "[^]") {
+    _at_begin = true;
+  } else if (expr == "[$]") {
+    _at_begin = false;
+  } else {
+    throw std::runtime_error("Invalid anchor " + expr);
+  }
+  set_max_len(0);
+  set_min_len(0);
+}
+
+void AnchorOpNode::freeze(FrozenNode& node, FrozenTrieBuilder& builder) const {
+  OpNode::freeze(node, builder);
+  node.kind = _at_begin ? OpKind::ANCHOR_BEGIN : OpKind::ANCHOR_END;
+}
+
+}  // namespace optrie
@@ -1,85 +1,342 @@
-#include <fstream>
+#include <algorithm>
 #include "dict_op.h"
+#include "frozen_trie.h"
 #include "utils.h"
 #include "log_utils.h"
+#include "match_stats.h"
 
 namespace optrie {
 
+DictTrie::DictTrie(const WordSet& words) {
+  // 先建一棵邻接表形式的树：WordSet有序，所以每个节点的出边按字符递增追加
+  std::vector<std::vector<std::pair<wchar_t, uint32_t>>> edges(1);
+  std::vector<bool> is_word(1, false);
+  for (auto& word : words) {
+    uint32_t node = 0;
+    for (auto ch : word) {
+      auto& out = edges[node];
+      if (!out.empty() && out.back().first == ch) {
+        node = out.back().second;
+      } else {
+        auto next = static_cast<uint32_t>(edges.size());
+        out.emplace_back(ch, next);
+        edges.emplace_back();
+        is_word.push_back(false);
+        node = next;
+      }
+    }
+    is_word[node] = true;
+  }
+  // 再按层序重新编号，摊平成连续数组
+  std::vector<uint32_t> order{0};
+  std::vector<uint32_t> new_id(edges.size(), 0);
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (auto& edge : edges[order[i]]) {
+      new_id[edge.second] = static_cast<uint32_t>(order.size());
+      order.emplace_back(edge.second);
+    }
+  }
+  _nodes.reserve(order.size());
+  for (auto old_id : order) {
+    DictTrieNode node{static_cast<uint32_t>(_labels.size()), 0, is_word[old_id]};
+    for (auto& edge : edges[old_id]) {
+      _labels.emplace_back(edge.first);
+      _targets.emplace_back(new_id[edge.second]);
+    }
+    node.edge_end = static_cast<uint32_t>(_labels.size());
+    _nodes.emplace_back(node);
+  }
+  _view = DictTrieView(_nodes, _labels, _targets, words.size());
+}
+
+uint32_t DictTrieView::child(uint32_t node, wchar_t ch) const {
+  auto& n = _nodes[node];
+  // 出边少时顺序查找更快
+  if (n.edge_end - n.edge_begin <= 8) {
+    for (uint32_t i = n.edge_begin; i < n.edge_end; ++i) {
+      if (_labels[i] == ch) {
+        return _targets[i];
+      }
+    }
+    return 0;
+  }
+  auto begin = _labels.begin() + n.edge_begin, end = _labels.begin() + n.edge_end;
+  auto iter = std::lower_bound(begin, end, ch);
+  return (iter != end && *iter == ch) ? _targets[iter - _labels.begin()] : 0;
+}
+
+uint64_t DictTrieView::prefix_lengths(std::wstring_view s, size_t pos, size_t max_len, size_t& depth) const {
+  OPTRIE_STATS(++match_stats().dict_probes);
+  uint64_t lengths = 0;
+  uint32_t node = 0;
+  size_t limit = min(max_len, s.length() - pos);
+  depth = 0;
+  while (depth < limit && (node = child(node, s[pos + depth])) != 0) {
+    ++depth;
+    if (_nodes[node].is_word && depth < 64) {
+      lengths |= uint64_t(1) << depth;
+    }
+  }
+  return lengths;
+}
+
+bool DictTrieView::contains(std::wstring_view word) const {
+  OPTRIE_STATS(++match_stats().dict_probes);
+  uint32_t node = 0;
+  for (auto ch : word) {
+    if ((node = child(node, ch)) == 0) {
+      return false;
+    }
+  }
+  return _nodes[node].is_word;
+}
+
 void PatternDict::get(const std::string& pat,
-                      std::shared_ptr<WordSet>& words, size_t& min_len, size_t& max_len) const {
-  auto w_iter = _pat_words_map.find(pat);
-  auto l_iter = _pat_length_range.find(pat);
-  if (w_iter == _pat_words_map.end() || l_iter == _pat_length_range.end()) {
+                      std::shared_ptr<const DictTrie>& dict, LengthSet& lengths) const {
+  auto d_iter = _pat_tries.find(pat);
+  auto l_iter = _pat_lengths.find(pat);
+  if (d_iter == _pat_tries.end() || l_iter == _pat_lengths.end()) {
     throw std::runtime_error("Dict " + pat + " does not exist");
   } else {
-    words = w_iter->second;
-    min_len  = l_iter->second.first;
-    max_len  = l_iter->second.second;
+    dict = d_iter->second;
+    lengths = l_iter->second;
   }
 }
 
+namespace {
+
+// 并行解析时每块的大小（字节）
+const size_t DICT_CHUNK_SIZE = 1 << 20;
+// 从词列表加载时每块的词数
+const size_t DICT_WORDS_CHUNK_SIZE = 1 << 16;
+
+// 块内连续属于同一词典的词
+// pat_name为空表示块开头、遇到词典名之前的词，属于前面的块最后出现的词典
+struct DictSegment {
+  std::string pat_name;
+  std::vector<std::wstring> words;  // 已排序去重
+};
+
+void sort_unique(std::vector<std::wstring>& words) {
+  std::sort(words.begin(), words.end());
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+}
+
+// 解析一块文本（只包含完整的行）
+void parse_dict_chunk(std::string_view chunk, std::vector<DictSegment>& segments) {
+  segments.emplace_back();
+  while (!chunk.empty()) {
+    size_t end = chunk.find('\n');
+    auto line = trim_view(chunk.substr(0, end));
+    chunk.remove_prefix(end == std::string_view::npos ? chunk.size() : end + 1);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (line.compare(0, 3, "[D:") == 0) {
+      segments.emplace_back();
+      segments.back().pat_name = std::string(line);
+    } else {
+      segments.back().words.emplace_back(to_lower(utf8_to_wstring(line)));
+    }
+  }
+  for (auto& segment : segments) {
+    sort_unique(segment.words);
+  }
+}
+
+// 把若干个各自有序的段归并成一个有序去重的词表
+std::vector<std::wstring> merge_words(std::vector<std::vector<std::wstring>*>& runs) {
+  std::vector<std::wstring> words;
+  std::vector<size_t> bounds{0};
+  for (auto run : runs) {
+    words.insert(words.end(), std::make_move_iterator(run->begin()), std::make_move_iterator(run->end()));
+    bounds.emplace_back(words.size());
+  }
+  // 两两归并，每轮段数减半
+  for (size_t step = 1; step + 1 < bounds.size(); step *= 2) {
+    for (size_t i = 0; i + step + 1 < bounds.size(); i += 2 * step) {
+      size_t last = min(i + 2 * step, bounds.size() - 1);
+      std::inplace_merge(words.begin() + bounds[i], words.begin() + bounds[i + step],
+                         words.begin() + bounds[last]);
+    }
+  }
+  words.erase(std::unique(words.begin(), words.end()), words.end());
+  return words;
+}
+
+}  // namespace
+
 void PatternDict::load(const std::vector<std::string>& dict_files) {
-  std::string line;
-  std::ifstream fi;
-  for (auto& dict_file : dict_files) {
-    fi.open(dict_file);
-    if (!fi.is_open()) {
-      throw std::runtime_error("Failed to open template dict file: " + dict_file);
+  std::vector<std::string> contents(dict_files.size());
+  parallel_for(dict_files.size(), [&](size_t i) {
+    if (!read_file(dict_files[i], contents[i])) {
+      throw std::runtime_error("Failed to open template dict file: " + dict_files[i]);
     }
+  });
+  load_texts(std::vector<std::string_view>(contents.begin(), contents.end()), dict_files);
+}
+
+void PatternDict::load_text(std::string_view text) {
+  load_texts({text}, {"<memory>"});
+}
+
+void PatternDict::load(const std::map<std::string, std::vector<std::string>>& dicts) {
+  // 1. 词列表切块，每块并行转换成一个有序的段
+  struct Chunk {
     std::string pat_name;
-    while (std::getline(fi, line)) {
-      line = trim(line);
-      if (line.empty() || line[0] == '#') {
-        continue;
+    const std::vector<std::string>* words;
+    size_t begin;
+    size_t end;
+  };
+  std::vector<Chunk> chunks;
+  for (auto& iter : dicts) {
+    // 词典名同词典文件，也可以省略外面的[D:]
+    auto pat_name = iter.first.compare(0, 3, "[D:") == 0 ? iter.first : "[D:" + iter.first + "]";
+    for (size_t begin = 0; begin < iter.second.size(); begin += DICT_WORDS_CHUNK_SIZE) {
+      chunks.push_back({pat_name, &iter.second, begin, min(begin + DICT_WORDS_CHUNK_SIZE, iter.second.size())});
+    }
+  }
+  std::vector<DictSegment> segments(chunks.size());
+  parallel_for(chunks.size(), [&](size_t i) {
+    auto& chunk = chunks[i];
+    auto& words = segments[i].words;
+    for (size_t j = chunk.begin; j < chunk.end; ++j) {
+      auto word = trim_view((*chunk.words)[j]);
+      if (!word.empty()) {
+        words.emplace_back(to_lower(utf8_to_wstring(word)));
       }
-      if (line.find("[D:") == 0) {
-        pat_name = line;
-      } else if (!pat_name.empty()) {
-        auto iter = _pat_words_map.find(pat_name);
-        std::shared_ptr<WordSet> words = nullptr;
-        if (iter != _pat_words_map.end()) {
-          words = iter->second;
-        } else {
-          words = std::make_shared<WordSet>();
-          _pat_words_map[pat_name] = words;
+    }
+    sort_unique(words);
+  });
+  // 2. 按词典分组后合并
+  WordRunsMap grouped;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (!segments[i].words.empty()) {
+      grouped[chunks[i].pat_name].emplace_back(&segments[i].words);
+    }
+  }
+  LOG_INFO("All dict parsed");
+  merge(grouped);
+}
+
+void PatternDict::load_texts(const std::vector<std::string_view>& texts,
+                             const std::vector<std::string>& sources) {
+  // 先在副本上更新，全部解析成功后再替换，不影响正在用的词典，失败时也不会留下一半
+  // 1. 按行边界切块
+  std::vector<std::string_view> chunks;
+  std::vector<size_t> file_begin;  // 每个文件的第一块
+  for (auto& text : texts) {
+    std::vector<std::string_view> file_chunks;
+    split_chunks(text, DICT_CHUNK_SIZE, file_chunks);
+    file_begin.emplace_back(chunks.size());
+    chunks.insert(chunks.end(), file_chunks.begin(), file_chunks.end());
+  }
+  file_begin.emplace_back(chunks.size());
+
+  // 2. 各块并行解析（UTF-8转换、排序去重）
+  std::vector<std::vector<DictSegment>> chunk_segments(chunks.size());
+  parallel_for(chunks.size(), [&](size_t i) {
+    parse_dict_chunk(chunks[i], chunk_segments[i]);
+  });
+  for (auto& source : sources) {
+    LOG_INFO("Parse optrie dict [%s] done", source.c_str());
+  }
+
+  // 3. 按文件和块的顺序确定每段所属的词典（每个文件单独从头开始），按词典分组
+  WordRunsMap grouped;
+  for (size_t f = 0; f < texts.size(); ++f) {
+    std::string pat_name;
+    for (size_t i = file_begin[f]; i < file_begin[f + 1]; ++i) {
+      for (auto& segment : chunk_segments[i]) {
+        if (!segment.pat_name.empty()) {
+          pat_name = segment.pat_name;
+        }
+        if (!pat_name.empty() && !segment.words.empty()) {
+          grouped[pat_name].emplace_back(&segment.words);
         }
-        words->emplace(to_lower(utf8_to_wstring(line)));
       }
     }
-    LOG_INFO("Parse optrie dict [%s] done", dict_file.c_str());
-    fi.close();
   }
-
   LOG_INFO("All dict parsed");
-  for (auto iter : _pat_words_map) {
-    auto pat_name = iter.first;
-    size_t min_len = 1<<20, max_len = 0;
-    for (auto& word : *iter.second) {
-      size_t len = word.length();
-      min_len = min(min_len, len);
-      max_len = max(max_len, len);
-    }
-    _pat_length_range[pat_name] = {min_len, max_len};
+  merge(grouped);
+}
+
+void PatternDict::merge(WordRunsMap& grouped) {
+  // 各词典并行合并（已有的词作为第一段）、统计词长、编译前缀树，只重建有变化的词典
+  struct Updated {
+    std::string pat_name;
+    std::vector<std::vector<std::wstring>*> runs;
+    std::shared_ptr<WordSet> words;
+    LengthSet lengths;
+    std::shared_ptr<const DictTrie> trie;
+    size_t min_len = 1<<20;
+    size_t max_len = 0;
+  };
+  std::vector<Updated> updated;
+  for (auto& iter : grouped) {
+    updated.emplace_back();
+    updated.back().pat_name = iter.first;
+    updated.back().runs = std::move(iter.second);
+  }
+  parallel_for(updated.size(), [&](size_t i) {
+    auto& dict = updated[i];
+    std::vector<std::wstring> existing;
+    auto iter = _pat_words_map.find(dict.pat_name);
+    if (iter != _pat_words_map.end()) {
+      existing.assign(iter->second->begin(), iter->second->end());
+      dict.runs.insert(dict.runs.begin(), &existing);
+    }
+    auto words = merge_words(dict.runs);
+    for (auto& word : words) {
+      dict.min_len = min(dict.min_len, word.length());
+      dict.max_len = max(dict.max_len, word.length());
+    }
+    // 容量取最长的词，不丢任何长度，用的时候再按MAX_LEN截断
+    dict.lengths = LengthSet(dict.max_len);
+    for (auto& word : words) {
+      dict.lengths.set(word.length());
+    }
+    // 有序输入，逐个插在末尾，线性时间建树
+    dict.words = std::make_shared<WordSet>(std::make_move_iterator(words.begin()),
+                                           std::make_move_iterator(words.end()));
+    dict.trie = std::make_shared<const DictTrie>(*dict.words);
+  });
+  for (auto& dict : updated) {
+    _pat_words_map[dict.pat_name] = dict.words;
+    _pat_lengths[dict.pat_name] = dict.lengths;
+    _pat_tries[dict.pat_name] = dict.trie;
     LOG_INFO("Pattern: %s, size: %zu, length range: [%zu, %zu]",
-             pat_name.c_str(), iter.second->size(), min_len, max_len);
+             dict.pat_name.c_str(), dict.words->size(), dict.min_len, dict.max_len);
   }
 }
 
-void DictOpNode::init(const PatternDict& pat_dic) {
-  size_t min_len, max_len;
-  pat_dic.get(expr, _words, min_len, max_len);
-  set_max_len(max_len);
-  set_min_len(min_len);
+void DictOpNode::refresh() {
+  // 词典可能变长或变短，长度范围要从头算
+  _max_len = MAX_LEN;
+  _min_len = 0;
+  init();
+}
+
+void DictOpNode::init() {
+  std::shared_ptr<const DictTrie> dict;
+  _pat_dic->get(expr, dict, _lengths);
+  set_max_len(_lengths.max());
+  set_min_len(_lengths.min());
 }
 
-MatchIterator DictOpNode::match(const std::wstring& s, size_t start) const {
-  size_t max_len = min(_max_len, relu(s.length() - start - _child_min_len));
-  size_t min_len = max(_min_len, relu(s.length() - start - _child_max_len));
-  return MatchIterator(this, s, start, max_len, min_len, -1);
+LengthSet DictOpNode::lengths() const {
+  auto result = OpNode::lengths();
+  result &= _lengths;
+  return result;
 }
 
-bool DictOpNode::match_next(const std::wstring& s, size_t start, size_t length) const {
-  return _words->find(s.substr(start, length)) != _words->end();
+void DictOpNode::freeze(FrozenNode& node, FrozenTrieBuilder& builder) const {
+  OpNode::freeze(node, builder);
+  std::shared_ptr<const DictTrie> dict;
+  LengthSet lengths;
+  _pat_dic->get(expr, dict, lengths);
+  node.kind = OpKind::DICT;
+  node.arg = builder.add_dict(dict);
 }
 
 }  // namespace optrie
\ No newline at end of file
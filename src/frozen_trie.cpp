@@ -0,0 +1,741 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "frozen_trie.h"
+#include "log_utils.h"
+#include "match_stats.h"
+
+namespace optrie {
+
+namespace {
+
+// 镜像布局：头部 + 各段数据，每段按8字节对齐，段内只存相对镜像起点的偏移
+const char IMAGE_MAGIC[8] = {'O', 'P', 'T', 'R', 'I', 'E', '\0', '\0'};
+// 写入时的字节序标记，读出来不一致说明是不同字节序的机器生成的
+const uint32_t IMAGE_ENDIAN = 0x01020304;
+
+enum ImageSectionId {
+  SECTION_NODES,
+  SECTION_CHARS,
+  SECTION_LENGTH_WORDS,
+  SECTION_DICTS,      // ImageDict数组
+  SECTION_DICT_DATA,  // 各词典前缀树的数组
+  SECTION_TEMPLATES,
+  SECTION_FIELDS,
+  SECTION_STRINGS,
+  SECTION_NODE_EXPRS,
+  SECTION_LITERALS,
+  SECTION_NODE_DISPATCH,
+  SECTION_DISPATCHES,
+  SECTION_DISPATCH_SLOTS,
+  SECTION_DISPATCH_CHILDREN,
+  NUM_SECTIONS,
+};
+
+struct ImageSection {
+  uint64_t offset;  // 相对镜像起点的字节偏移
+  uint64_t size;    // 字节数
+};
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t wchar_size;   // wchar_t在不同平台上宽度不同
+  uint32_t node_size;    // sizeof(FrozenNode)，防止不同编译器的布局差异
+  uint64_t image_size;
+  uint64_t length_set_words;
+  ImageSection sections[NUM_SECTIONS];
+};
+
+// 一个词典前缀树的三个数组，偏移相对镜像起点
+struct ImageDict {
+  uint64_t nodes;
+  uint64_t num_nodes;
+  uint64_t labels;
+  uint64_t targets;
+  uint64_t num_edges;
+  uint64_t num_words;
+};
+
+inline size_t align8(size_t n) {
+  return (n + 7) & ~size_t(7);
+}
+
+inline bool in_image(uint64_t offset, uint64_t size, size_t image_size) {
+  return offset % 8 == 0 && offset <= image_size && size <= image_size - offset;
+}
+
+template <class T>
+ArrayView<T> image_array(const char* base, uint64_t offset, uint64_t count, size_t image_size) {
+  if (count > image_size / sizeof(T) || !in_image(offset, count * sizeof(T), image_size)) {
+    throw std::runtime_error("Corrupted optrie image");
+  }
+  return ArrayView<T>(reinterpret_cast<const T*>(base + offset), count);
+}
+
+// 字面索引的哈希（FNV-1a）
+inline uint32_t literal_hash(std::wstring_view s) {
+  uint32_t h = 2166136261u;
+  for (auto ch : s) {
+    h = (h ^ static_cast<uint32_t>(ch)) * 16777619u;
+  }
+  return h;
+}
+
+// 分派表的哈希
+inline uint32_t dispatch_hash(uint32_t ch) {
+  uint32_t h = ch * 0x9E3779B1u;
+  return h ^ (h >> 16);
+}
+
+}  // namespace
+
+uint32_t FrozenTrieBuilder::add_chars(const std::wstring& str) {
+  uint32_t offset = static_cast<uint32_t>(_chars.size());
+  _chars.insert(_chars.end(), str.begin(), str.end());
+  return offset;
+}
+
+uint32_t FrozenTrieBuilder::add_dict(std::shared_ptr<const DictTrie> dict) {
+  for (size_t i = 0; i < _dicts.size(); ++i) {
+    if (_dicts[i] == dict) {
+      return static_cast<uint32_t>(i);
+    }
+  }
+  _dicts.emplace_back(dict);
+  return static_cast<uint32_t>(_dicts.size() - 1);
+}
+
+uint32_t FrozenTrieBuilder::add_length_set(const LengthSet& lengths) {
+  auto& words = lengths.words();
+  if (_length_set_words == 0) {
+    _length_set_words = words.size();
+  } else if (_length_set_words != words.size()) {
+    throw std::runtime_error("Inconsistent length set capacity");
+  }
+  uint32_t offset = static_cast<uint32_t>(_length_words.size());
+  _length_words.insert(_length_words.end(), words.begin(), words.end());
+  return offset;
+}
+
+FrozenString FrozenTrieBuilder::add_string(const std::string& str) {
+  FrozenString res{static_cast<uint32_t>(_strings.size()), static_cast<uint32_t>(str.length())};
+  _strings += str;
+  return res;
+}
+
+uint32_t FrozenTrieBuilder::add_template(const std::string& tpl, double score,
+                                         const std::map<std::string, std::string>& extra,
+                                         const std::map<std::string, size_t>& extractors, bool has_next) {
+  FrozenTemplate t;
+  t.tpl = add_string(tpl).offset;
+  t.tpl_len = static_cast<uint32_t>(tpl.length());
+  t.score = score;
+  t.extra_begin = static_cast<uint32_t>(_fields.size());
+  for (auto& kv : extra) {
+    _fields.push_back({add_string(kv.first).offset, static_cast<uint32_t>(kv.first.length()),
+                       add_string(kv.second).offset, static_cast<uint32_t>(kv.second.length())});
+  }
+  t.extra_end = static_cast<uint32_t>(_fields.size());
+  t.extractor_begin = t.extra_end;
+  for (auto& kv : extractors) {
+    _fields.push_back({add_string(kv.first).offset, static_cast<uint32_t>(kv.first.length()),
+                       static_cast<uint32_t>(kv.second), 0});
+  }
+  t.extractor_end = static_cast<uint32_t>(_fields.size());
+  t.next = has_next ? static_cast<uint32_t>(_templates.size() + 1) : 0;
+  _templates.emplace_back(t);
+  return static_cast<uint32_t>(_templates.size() - 1);
+}
+
+void FrozenTrieBuilder::index_literals() {
+  _literals.clear();
+  if (nodes.empty()) {
+    return;
+  }
+  std::vector<FrozenLiteral> entries;
+  uint32_t prior = 0;
+  for (uint32_t child = nodes[0].child_begin; child < nodes[0].child_end; ++child) {
+    auto& node = nodes[child];
+    // 只有子节点的字面节点还是其他模板的前缀，留在树里
+    if (node.kind == OpKind::LITERAL && node.is_end && node.child_begin == node.child_end) {
+      node.literal_indexed = true;
+      entries.push_back({child, prior});
+    } else {
+      ++prior;
+    }
+  }
+  if (entries.empty()) {
+    return;
+  }
+  // 装载率不超过1/2
+  size_t size = 1;
+  while (size < entries.size() * 2) {
+    size <<= 1;
+  }
+  _literals.assign(size, {0, 0});
+  for (auto& entry : entries) {
+    auto& node = nodes[entry.node];
+    size_t i = literal_hash(std::wstring_view(_chars.data() + node.arg, node.arg_len)) & (size - 1);
+    while (_literals[i].node != 0) {
+      i = (i + 1) & (size - 1);
+    }
+    _literals[i] = entry;
+  }
+}
+
+void FrozenTrieBuilder::index_children() {
+  _node_dispatch.assign(nodes.size(), FrozenTrie::NO_DISPATCH);
+  _dispatches.clear();
+  _dispatch_slots.clear();
+  _dispatch_children.clear();
+  for (uint32_t node_id = 0; node_id < nodes.size(); ++node_id) {
+    auto& node = nodes[node_id];
+    if (node.child_end - node.child_begin < FrozenTrie::DISPATCH_MIN_CHILDREN) {
+      continue;
+    }
+    // 首字符 -> (普通子节点, 字面叶子)，子节点按下标顺序加入，各自有序
+    std::map<uint32_t, std::pair<std::vector<uint32_t>, std::vector<uint32_t>>> buckets;
+    FrozenDispatch dispatch;
+    dispatch.any_begin = static_cast<uint32_t>(_dispatch_children.size());
+    for (uint32_t child = node.child_begin; child < node.child_end; ++child) {
+      auto& child_node = nodes[child];
+      if (child_node.kind == OpKind::LITERAL && child_node.arg_len > 0) {
+        auto& bucket = buckets[static_cast<uint32_t>(_chars[child_node.arg])];
+        (child_node.literal_indexed ? bucket.second : bucket.first).push_back(child);
+        continue;
+      }
+      if (child_node.kind == OpKind::DICT) {
+        auto& view = _dicts[child_node.arg]->view();
+        auto& root = view.nodes()[0];
+        if (!root.is_word && root.edge_end - root.edge_begin <= FrozenTrie::DISPATCH_MAX_DICT_CHARS) {
+          for (uint32_t edge = root.edge_begin; edge < root.edge_end; ++edge) {
+            buckets[static_cast<uint32_t>(view.labels()[edge])].first.push_back(child);
+          }
+          continue;
+        }
+      }
+      _dispatch_children.push_back(child);
+    }
+    dispatch.any_end = static_cast<uint32_t>(_dispatch_children.size());
+    // 装载率不超过1/2
+    uint32_t num_slots = 1;
+    while (num_slots < buckets.size() * 2) {
+      num_slots <<= 1;
+    }
+    dispatch.slot_begin = static_cast<uint32_t>(_dispatch_slots.size());
+    dispatch.num_slots = num_slots;
+    _dispatch_slots.resize(_dispatch_slots.size() + num_slots, {0, 0, 0, 0});
+    auto slots = _dispatch_slots.data() + dispatch.slot_begin;
+    for (auto& bucket : buckets) {
+      FrozenDispatchSlot slot;
+      slot.ch = bucket.first;
+      slot.begin = static_cast<uint32_t>(_dispatch_children.size());
+      _dispatch_children.insert(_dispatch_children.end(), bucket.second.first.begin(), bucket.second.first.end());
+      slot.mid = static_cast<uint32_t>(_dispatch_children.size());
+      _dispatch_children.insert(_dispatch_children.end(), bucket.second.second.begin(), bucket.second.second.end());
+      slot.end = static_cast<uint32_t>(_dispatch_children.size());
+      size_t i = dispatch_hash(slot.ch) & (num_slots - 1);
+      while (slots[i].end != 0) {
+        i = (i + 1) & (num_slots - 1);
+      }
+      slots[i] = slot;
+    }
+    node.dispatched = true;
+    _node_dispatch[node_id] = static_cast<uint32_t>(_dispatches.size());
+    _dispatches.push_back(dispatch);
+  }
+}
+
+std::unique_ptr<FrozenTrie> FrozenTrieBuilder::build() const {
+  // 1. 排布各段
+  ImageHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  header.version = FrozenTrie::IMAGE_VERSION;
+  header.endian = IMAGE_ENDIAN;
+  header.wchar_size = sizeof(wchar_t);
+  header.node_size = sizeof(FrozenNode);
+  header.length_set_words = _length_set_words;
+
+  std::vector<ImageDict> image_dicts;
+  size_t dict_data_size = 0;
+  for (auto& dict : _dicts) {
+    auto& view = dict->view();
+    ImageDict d;
+    d.num_nodes = view.nodes().size();
+    d.num_edges = view.labels().size();
+    d.num_words = view.size();
+    // 先记段内偏移，排好段之后再加上段的起点
+    d.nodes = dict_data_size;
+    dict_data_size = align8(dict_data_size + d.num_nodes * sizeof(DictTrieNode));
+    d.labels = dict_data_size;
+    dict_data_size = align8(dict_data_size + d.num_edges * sizeof(wchar_t));
+    d.targets = dict_data_size;
+    dict_data_size = align8(dict_data_size + d.num_edges * sizeof(uint32_t));
+    image_dicts.emplace_back(d);
+  }
+
+  const void* section_data[NUM_SECTIONS] = {
+    nodes.data(), _chars.data(), _length_words.data(), image_dicts.data(),
+    nullptr, _templates.data(), _fields.data(), _strings.data(), node_exprs.data(), _literals.data(),
+    _node_dispatch.data(), _dispatches.data(), _dispatch_slots.data(), _dispatch_children.data(),
+  };
+  size_t section_size[NUM_SECTIONS] = {
+    nodes.size() * sizeof(FrozenNode),
+    _chars.size() * sizeof(wchar_t),
+    _length_words.size() * sizeof(uint64_t),
+    image_dicts.size() * sizeof(ImageDict),
+    dict_data_size,
+    _templates.size() * sizeof(FrozenTemplate),
+    _fields.size() * sizeof(FrozenField),
+    _strings.size(),
+    node_exprs.size() * sizeof(FrozenString),
+    _literals.size() * sizeof(FrozenLiteral),
+    _node_dispatch.size() * sizeof(uint32_t),
+    _dispatches.size() * sizeof(FrozenDispatch),
+    _dispatch_slots.size() * sizeof(FrozenDispatchSlot),
+    _dispatch_children.size() * sizeof(uint32_t),
+  };
+  size_t offset = align8(sizeof(ImageHeader));
+  for (size_t i = 0; i < NUM_SECTIONS; ++i) {
+    header.sections[i] = {offset, section_size[i]};
+    offset = align8(offset + section_size[i]);
+  }
+  header.image_size = offset;
+  size_t dict_data_offset = header.sections[SECTION_DICT_DATA].offset;
+  for (auto& d : image_dicts) {
+    d.nodes += dict_data_offset;
+    d.labels += dict_data_offset;
+    d.targets += dict_data_offset;
+  }
+
+  // 2. 拷贝到一块连续的缓冲（按uint64_t分配，保证8字节对齐）
+  auto buffer = std::make_shared<std::vector<uint64_t>>(offset / 8, 0);
+  auto base = reinterpret_cast<char*>(buffer->data());
+  std::memcpy(base, &header, sizeof(header));
+  for (size_t i = 0; i < NUM_SECTIONS; ++i) {
+    if (section_data[i] != nullptr && section_size[i] > 0) {
+      std::memcpy(base + header.sections[i].offset, section_data[i], section_size[i]);
+    }
+  }
+  for (size_t i = 0; i < _dicts.size(); ++i) {
+    auto& view = _dicts[i]->view();
+    auto& d = image_dicts[i];
+    std::memcpy(base + d.nodes, view.nodes().data(), d.num_nodes * sizeof(DictTrieNode));
+    std::memcpy(base + d.labels, view.labels().data(), d.num_edges * sizeof(wchar_t));
+    std::memcpy(base + d.targets, view.targets().data(), d.num_edges * sizeof(uint32_t));
+  }
+  return std::make_unique<FrozenTrie>(base, offset, buffer);
+}
+
+FrozenTrie::FrozenTrie(const void* data, size_t size, std::shared_ptr<const void> owner)
+    : _data(data), _size(size), _owner(owner) {
+  // 除了头部和各段的边界，还要校验段内的下标（见validate），损坏的镜像在这里报错，不会在匹配时越界
+  if (size < sizeof(ImageHeader) || reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+    throw std::runtime_error("Invalid optrie image");
+  }
+  auto& header = *static_cast<const ImageHeader*>(data);
+  if (std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+    throw std::runtime_error("Not an optrie image");
+  }
+  if (header.version != IMAGE_VERSION) {
+    throw std::runtime_error("Unsupported optrie image version: " + std::to_string(header.version));
+  }
+  if (header.endian != IMAGE_ENDIAN || header.wchar_size != sizeof(wchar_t) ||
+      header.node_size != sizeof(FrozenNode)) {
+    throw std::runtime_error("Optrie image built on an incompatible platform");
+  }
+  if (header.image_size != size) {
+    throw std::runtime_error("Truncated optrie image");
+  }
+  auto base = static_cast<const char*>(data);
+  auto section = [&](ImageSectionId id, size_t elem_size) {
+    auto& sec = header.sections[id];
+    if (sec.size % elem_size != 0) {
+      throw std::runtime_error("Corrupted optrie image");
+    }
+    return std::make_pair(sec.offset, sec.size / elem_size);
+  };
+  auto sec = section(SECTION_NODES, sizeof(FrozenNode));
+  nodes = image_array<FrozenNode>(base, sec.first, sec.second, size);
+  sec = section(SECTION_CHARS, sizeof(wchar_t));
+  chars = image_array<wchar_t>(base, sec.first, sec.second, size);
+  sec = section(SECTION_LENGTH_WORDS, sizeof(uint64_t));
+  length_words = image_array<uint64_t>(base, sec.first, sec.second, size);
+  sec = section(SECTION_TEMPLATES, sizeof(FrozenTemplate));
+  templates = image_array<FrozenTemplate>(base, sec.first, sec.second, size);
+  sec = section(SECTION_FIELDS, sizeof(FrozenField));
+  fields = image_array<FrozenField>(base, sec.first, sec.second, size);
+  sec = section(SECTION_STRINGS, 1);
+  strings = image_array<char>(base, sec.first, sec.second, size);
+  sec = section(SECTION_NODE_EXPRS, sizeof(FrozenString));
+  node_exprs = image_array<FrozenString>(base, sec.first, sec.second, size);
+  sec = section(SECTION_LITERALS, sizeof(FrozenLiteral));
+  literals = image_array<FrozenLiteral>(base, sec.first, sec.second, size);
+  sec = section(SECTION_NODE_DISPATCH, sizeof(uint32_t));
+  node_dispatch = image_array<uint32_t>(base, sec.first, sec.second, size);
+  sec = section(SECTION_DISPATCHES, sizeof(FrozenDispatch));
+  dispatches = image_array<FrozenDispatch>(base, sec.first, sec.second, size);
+  sec = section(SECTION_DISPATCH_SLOTS, sizeof(FrozenDispatchSlot));
+  dispatch_slots = image_array<FrozenDispatchSlot>(base, sec.first, sec.second, size);
+  sec = section(SECTION_DISPATCH_CHILDREN, sizeof(uint32_t));
+  dispatch_children = image_array<uint32_t>(base, sec.first, sec.second, size);
+  sec = section(SECTION_DICTS, sizeof(ImageDict));
+  for (auto& d : image_array<ImageDict>(base, sec.first, sec.second, size)) {
+    dicts.emplace_back(image_array<DictTrieNode>(base, d.nodes, d.num_nodes, size),
+                       image_array<wchar_t>(base, d.labels, d.num_edges, size),
+                       image_array<uint32_t>(base, d.targets, d.num_edges, size),
+                       d.num_words);
+  }
+  length_set_words = header.length_set_words;
+  validate();
+  template_counters = std::make_shared<TemplateCounters>(templates.size());
+}
+
+void FrozenTrie::validate() {
+  auto check = [](bool ok) {
+    if (!ok) {
+      throw std::runtime_error("Corrupted optrie image");
+    }
+  };
+  // 镜像里的bool只能是0或1，其他值读出来是未定义行为
+  auto is_bool = [](const bool& b) {
+    uint8_t v;
+    std::memcpy(&v, &b, 1);
+    return v <= 1;
+  };
+  // 池中的[offset, offset + len)
+  auto in_pool = [](uint64_t offset, uint64_t len, size_t pool_size) {
+    return offset <= pool_size && len <= pool_size - offset;
+  };
+  check(!nodes.empty() && node_exprs.size() == nodes.size() && node_dispatch.size() == nodes.size() &&
+        length_set_words > 0 && length_set_words <= length_words.size());
+  // 模板和字段
+  for (auto& tpl : templates) {
+    check(in_pool(tpl.tpl, tpl.tpl_len, strings.size()));
+    check(tpl.extra_begin <= tpl.extra_end && tpl.extra_end <= fields.size());
+    check(tpl.extractor_begin <= tpl.extractor_end && tpl.extractor_end <= fields.size());
+    for (uint32_t i = tpl.extra_begin; i < tpl.extra_end; ++i) {
+      check(in_pool(fields[i].key, fields[i].key_len, strings.size()) &&
+            in_pool(fields[i].value, fields[i].value_len, strings.size()));
+    }
+    for (uint32_t i = tpl.extractor_begin; i < tpl.extractor_end; ++i) {
+      check(in_pool(fields[i].key, fields[i].key_len, strings.size()));
+    }
+  }
+  // 词典前缀树
+  for (auto& dict : dicts) {
+    auto dict_nodes = dict.nodes();
+    check(!dict_nodes.empty());
+    for (auto& n : dict_nodes) {
+      check(n.edge_begin <= n.edge_end && n.edge_end <= dict.labels().size());
+    }
+    for (auto target : dict.targets()) {
+      check(target < dict_nodes.size());
+    }
+  }
+  // 节点：按层序存放，子节点区间首尾相接，父节点先于子节点，所以每个节点恰有一个父节点、不会成环
+  // 同时算出深度（ROOT为0，抽取项的下标要小于它）和max_span
+  std::vector<size_t> depth(nodes.size(), 0), span(nodes.size(), 0);
+  uint32_t next_child = 1, next_dispatch = 0, next_tpl = 0;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    auto& node = nodes[i];
+    check(node.child_begin == next_child && node.child_begin > i && node.child_begin <= node.child_end &&
+          node.child_end <= nodes.size());
+    next_child = node.child_end;
+    check(node.kind <= OpKind::ANCHOR_END && (node.kind == OpKind::ROOT) == (i == 0));
+    check(is_bool(node.is_end) && is_bool(node.literal_indexed) && is_bool(node.dispatched));
+    check(in_pool(node.lengths, length_set_words, length_words.size()) &&
+          in_pool(node.child_lengths, length_set_words, length_words.size()));
+    check(in_pool(node_exprs[i].offset, node_exprs[i].len, strings.size()));
+    if (node.kind == OpKind::LITERAL) {
+      check(in_pool(node.arg, node.arg_len, chars.size()));
+    } else if (node.kind == OpKind::DICT) {
+      check(node.arg < dicts.size());
+    }
+    // 终止节点的模板按节点顺序连续存放，每个模板恰好属于一个节点
+    if (node.is_end) {
+      check(node.tpl_id == next_tpl);
+      for (bool more = true; more; ++next_tpl) {
+        check(next_tpl < templates.size());
+        auto& tpl = templates[next_tpl];
+        for (uint32_t f = tpl.extractor_begin; f < tpl.extractor_end; ++f) {
+          check(fields[f].value < depth[i]);
+        }
+        check(tpl.next == 0 || tpl.next == next_tpl + 1);
+        more = tpl.next != 0;
+      }
+    }
+    for (uint32_t child = node.child_begin; child < node.child_end; ++child) {
+      depth[child] = depth[i] + 1;
+      span[child] = span[i] + nodes[child].max_len;
+      max_span = std::max(max_span, span[child]);
+    }
+    // 分派表：按节点顺序各有一张，分派池中只能是自己的子节点，分派格至少留一个空位（否则查找不会结束）
+    check(node.dispatched == (node_dispatch[i] != NO_DISPATCH));
+    if (!node.dispatched) {
+      continue;
+    }
+    check(node_dispatch[i] == next_dispatch++ && node_dispatch[i] < dispatches.size());
+    auto& dispatch = dispatches[node_dispatch[i]];
+    auto in_children = [&](uint32_t begin, uint32_t end) {
+      if (begin > end || end > dispatch_children.size()) {
+        return false;
+      }
+      for (uint32_t k = begin; k < end; ++k) {
+        if (dispatch_children[k] < node.child_begin || dispatch_children[k] >= node.child_end) {
+          return false;
+        }
+      }
+      return true;
+    };
+    check(dispatch.num_slots > 0 && (dispatch.num_slots & (dispatch.num_slots - 1)) == 0 &&
+          in_pool(dispatch.slot_begin, dispatch.num_slots, dispatch_slots.size()));
+    check(in_children(dispatch.any_begin, dispatch.any_end));
+    bool has_empty = false;
+    for (uint32_t k = dispatch.slot_begin; k < dispatch.slot_begin + dispatch.num_slots; ++k) {
+      auto& slot = dispatch_slots[k];
+      if (slot.end == 0) {
+        has_empty = true;
+        continue;
+      }
+      check(slot.begin <= slot.mid && in_children(slot.begin, slot.end));
+    }
+    check(has_empty);
+  }
+  check(next_child == nodes.size() && next_dispatch == dispatches.size() && next_tpl == templates.size());
+  // 字面索引：大小为0或2的幂，指向ROOT下的字面叶子，至少留一个空位
+  check((literals.size() & (literals.size() - 1)) == 0);
+  bool has_empty = literals.empty();
+  for (auto& literal : literals) {
+    if (literal.node == 0) {
+      has_empty = true;
+      continue;
+    }
+    check(literal.node >= nodes[0].child_begin && literal.node < nodes[0].child_end &&
+          nodes[literal.node].kind == OpKind::LITERAL);
+  }
+  check(has_empty);
+}
+
+const FrozenLiteral* FrozenTrie::find_literal(std::wstring_view s) const {
+  if (literals.empty()) {
+    return nullptr;
+  }
+  size_t mask = literals.size() - 1;
+  for (size_t i = literal_hash(s) & mask; literals[i].node != 0; i = (i + 1) & mask) {
+    auto& node = nodes[literals[i].node];
+    if (std::wstring_view(chars.data() + node.arg, node.arg_len) == s) {
+      return &literals[i];
+    }
+  }
+  return nullptr;
+}
+
+const FrozenDispatchSlot* FrozenTrie::find_dispatch(const FrozenDispatch& dispatch, wchar_t ch) const {
+  auto slots = dispatch_slots.data() + dispatch.slot_begin;
+  size_t mask = dispatch.num_slots - 1;
+  auto key = static_cast<uint32_t>(ch);
+  for (size_t i = dispatch_hash(key) & mask; slots[i].end != 0; i = (i + 1) & mask) {
+    if (slots[i].ch == key) {
+      return &slots[i];
+    }
+  }
+  return nullptr;
+}
+
+std::unique_ptr<FrozenTrie> FrozenTrie::open(const std::string& path) {
+#ifdef _WIN32
+  // 没有mmap时整体读入内存
+  std::ifstream fi(path, std::ios::binary | std::ios::ate);
+  if (!fi.is_open()) {
+    throw std::runtime_error("Failed to open optrie image: " + path);
+  }
+  size_t size = static_cast<size_t>(fi.tellg());
+  auto buffer = std::make_shared<std::vector<uint64_t>>((size + 7) / 8, 0);
+  fi.seekg(0);
+  fi.read(reinterpret_cast<char*>(buffer->data()), size);
+  if (!fi) {
+    throw std::runtime_error("Failed to read optrie image: " + path);
+  }
+  return std::make_unique<FrozenTrie>(buffer->data(), size, buffer);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Failed to open optrie image: " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    throw std::runtime_error("Invalid optrie image: " + path);
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  // 只读共享映射：页面按需载入，多个进程打开同一文件时共用page cache
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error("Failed to mmap optrie image: " + path);
+  }
+  std::shared_ptr<const void> owner(addr, [size](const void* p) {
+    munmap(const_cast<void*>(p), size);
+  });
+  return std::make_unique<FrozenTrie>(addr, size, owner);
+#endif
+}
+
+std::unique_ptr<FrozenTrie> FrozenTrie::to_shared_memory() const {
+#ifdef _WIN32
+  throw std::runtime_error("Shared memory trie is not supported on Windows");
+#else
+  size_t size = _size;
+  void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error("Failed to allocate shared memory for optrie image");
+  }
+  std::shared_ptr<const void> owner(addr, [size](const void* p) {
+    munmap(const_cast<void*>(p), size);
+  });
+  std::memcpy(addr, _data, size);
+  // 拷贝完改为只读：匹配路径不会写这些页，误写也会直接报错，而不是悄悄触发写时复制
+  if (mprotect(addr, size, PROT_READ) != 0) {
+    throw std::runtime_error("Failed to protect shared memory for optrie image");
+  }
+  return std::make_unique<FrozenTrie>(addr, size, owner);
+#endif
+}
+
+void FrozenTrie::save(const std::string& path) const {
+  // 原地覆盖会让映射着旧文件的进程读到一半新数据（甚至SIGBUS），所以写临时文件后改名
+  std::string tmp_path = path + ".tmp";
+  std::ofstream fo(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!fo.is_open()) {
+    throw std::runtime_error("Failed to open file for writing: " + tmp_path);
+  }
+  fo.write(static_cast<const char*>(_data), _size);
+  fo.close();
+  if (!fo || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("Failed to save optrie image: " + path);
+  }
+}
+
+ChildCursor::ChildCursor(const FrozenTrie& trie, uint32_t node_id, std::wstring_view s, size_t pos,
+                         bool to_end, uint32_t literal_hit)
+    : _literal_hit(literal_hit) {
+  auto& node = trie.nodes[node_id];
+  auto& dispatch = trie.dispatches[trie.node_dispatch[node_id]];
+  auto pool = trie.dispatch_children.data();
+  _ranges[0] = _ranges[1] = {pool, pool};
+  _ranges[2] = {pool + dispatch.any_begin, pool + dispatch.any_end};
+  if (pos < s.length()) {
+    if (auto slot = trie.find_dispatch(dispatch, s[pos])) {
+      _ranges[0] = {pool + slot->begin, pool + slot->mid};
+      if (!to_end) {
+        _ranges[1] = {pool + slot->mid, pool + slot->end};
+      }
+    }
+  }
+  // 字面叶子都是ROOT的子节点，整串匹配时只有查到的那个可能匹配
+  if (to_end && literal_hit >= node.child_begin && literal_hit < node.child_end) {
+    _ranges[1] = {&_literal_hit, &_literal_hit + 1};
+  }
+}
+
+MatchIterator::MatchIterator(const FrozenTrie& trie, const FrozenNode& node, std::wstring_view s,
+                             size_t pos_start, bool to_end)
+    : _trie(trie), _node(node), _s(s), _pos_start(pos_start),
+      _rest(s.length() - pos_start), _to_end(to_end), _hits(0) {
+  size_t rest = _rest;
+  auto max_len = static_cast<int64_t>(node.match_max_len(rest));
+  auto min_len = static_cast<int64_t>(node.match_min_len(rest, to_end));
+  if (node.kind == OpKind::DICT) {
+    // 词典优先匹配长的
+    // 一次遍历前缀树拿到所有可匹配长度，不再对每个长度单独查词典
+    size_t depth = 0;
+    if (max_len >= min_len) {
+      _hits = trie.dicts[node.arg].prefix_lengths(s, pos_start, max_len, depth);
+      if (min_len > 0) {
+        _hits &= min_len < 64 ? ~((uint64_t(1) << min_len) - 1) : 0;
+      }
+    }
+    // 只有走得够深才需要确认>=64的长度
+    _len_start = static_cast<int64_t>(depth);
+    _len_end = std::max<int64_t>(min_len, 64);
+    _len_step = -1;
+  } else {
+    _len_start = min_len;
+    _len_end = max_len;
+    _len_step = 1;
+  }
+}
+
+bool MatchIterator::next(size_t& length) {
+  OPTRIE_STATS(++match_stats().iterator_steps);
+  if (_node.kind == OpKind::DICT) {
+    while (_len_start >= _len_end) {
+      auto len = _len_start--;
+      // 词典里没有这个长度的词就不用查
+      if (_trie.has_length(_node.lengths, len) && fit_children(len) &&
+          _trie.dicts[_node.arg].contains(_s.substr(_pos_start, len))) {
+        length = len;
+        return true;
+      }
+    }
+    while (_hits) {
+      auto len = highest_bit(_hits);
+      _hits ^= uint64_t(1) << len;
+      if (fit_children(len)) {
+        length = len;
+        return true;
+      }
+    }
+    return false;
+  }
+  while ((_len_end - _len_start) * _len_step >= 0) {
+    auto len = _len_start;
+    bool hit = fit_children(len) && match_next(len);
+    _len_start += _len_step;
+    if (hit) {
+      length = len;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MatchIterator::match_next(size_t length) const {
+  // 不用校验长度，构造时已经确定了长度范围
+  switch (_node.kind) {
+    case OpKind::LITERAL:
+      // 原地比较，不构造子串
+      return _s.substr(_pos_start, length) ==
+             std::wstring_view(_trie.chars.data() + _node.arg, _node.arg_len);
+    case OpKind::WILDCARD:
+      return true;
+    case OpKind::DICT:
+      return _trie.dicts[_node.arg].contains(_s.substr(_pos_start, length));
+    case OpKind::ANCHOR_BEGIN:
+      return _pos_start == 0;
+    case OpKind::ANCHOR_END:
+      return _pos_start == _s.length();
+    default:
+      return false;
+  }
+}
+
+void MatchIterator::debug_info() const {
+  LOG_DEBUG("Iterator of op[%d], length range(%ld, %ld, %ld), hits(%llx)",
+            static_cast<int>(_node.kind), _len_start, _len_end, _len_step,
+            static_cast<unsigned long long>(_hits));
+}
+
+}  // namespace optrie
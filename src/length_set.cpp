@@ -0,0 +1,81 @@
+#include "length_set.h"
+#include "utils.h"
+
+namespace optrie {
+
+void LengthSet::set_range(size_t min_len, size_t max_len) {
+  for (size_t len = min_len; len <= max_len && len <= _capacity; ++len) {
+    set(len);
+  }
+}
+
+bool LengthSet::empty() const {
+  for (auto word : _bits) {
+    if (word) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t LengthSet::min() const {
+  for (size_t i = 0; i < _bits.size(); ++i) {
+    if (_bits[i]) {
+      return i * 64 + lowest_bit(_bits[i]);
+    }
+  }
+  return static_cast<size_t>(-1);
+}
+
+size_t LengthSet::max() const {
+  for (size_t i = _bits.size(); i > 0; --i) {
+    if (_bits[i - 1]) {
+      return (i - 1) * 64 + highest_bit(_bits[i - 1]);
+    }
+  }
+  return 0;
+}
+
+LengthSet& LengthSet::operator|=(const LengthSet& other) {
+  or_shifted(other, 0);
+  return *this;
+}
+
+LengthSet& LengthSet::operator&=(const LengthSet& other) {
+  for (size_t i = 0; i < _bits.size(); ++i) {
+    _bits[i] &= i < other._bits.size() ? other._bits[i] : 0;
+  }
+  return *this;
+}
+
+LengthSet LengthSet::sum(const LengthSet& other) const {
+  LengthSet result(_capacity);
+  for (size_t b = 0; b <= other._capacity && b <= _capacity; ++b) {
+    if (other.test(b)) {
+      result.or_shifted(*this, b);
+    }
+  }
+  return result;
+}
+
+void LengthSet::or_shifted(const LengthSet& other, size_t shift) {
+  size_t word_shift = shift / 64, bit_shift = shift % 64;
+  for (size_t i = word_shift; i < _bits.size(); ++i) {
+    size_t src = i - word_shift;
+    uint64_t word = 0;
+    if (src < other._bits.size()) {
+      word = other._bits[src] << bit_shift;
+    }
+    if (bit_shift && src >= 1 && src - 1 < other._bits.size()) {
+      word |= other._bits[src - 1] >> (64 - bit_shift);
+    }
+    _bits[i] |= word;
+  }
+  // 丢弃超出capacity的位
+  size_t tail = _capacity % 64 + 1;
+  if (tail < 64) {
+    _bits.back() &= (uint64_t(1) << tail) - 1;
+  }
+}
+
+}  // namespace optrie
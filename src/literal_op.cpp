@@ -1,4 +1,5 @@
 #include "literal_op.h"
+#include "frozen_trie.h"
 #include "utils.h"
 
 namespace optrie {
@@ -9,15 +10,11 @@ void LiteralOpNode::init() {
     set_min_len(_w_expr.length());
 }
 
-MatchIterator LiteralOpNode::match(const std::wstring& s, size_t start) const {
-  size_t max_len = min(_max_len, max(0, s.length() - start - _child_min_len));
-  size_t min_len = max(_min_len, max(0, s.length() - start - _child_max_len));
-  return MatchIterator(this, s, start, min_len, max_len, 1);
-}
-
-bool LiteralOpNode::match_next(const std::wstring& s, size_t start, size_t length) const {
-  // 不用校验长度，MatchIterator 确定了长度范围
-  return s.substr(start, length) == _w_expr;
+void LiteralOpNode::freeze(FrozenNode& node, FrozenTrieBuilder& builder) const {
+  OpNode::freeze(node, builder);
+  node.kind = OpKind::LITERAL;
+  node.arg = builder.add_chars(_w_expr);
+  node.arg_len = static_cast<uint32_t>(_w_expr.length());
 }
 
 }  // namespace optrie
\ No newline at end of file
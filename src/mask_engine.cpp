@@ -0,0 +1,160 @@
+#include <algorithm>
+#include "mask_engine.h"
+#include "utils.h"
+
+namespace optrie {
+
+namespace {
+
+// 按位翻转
+inline uint64_t reverse_bits(uint64_t x) {
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  x = ((x >> 8) & 0x00FF00FF00FF00FFULL) | ((x & 0x00FF00FF00FF00FFULL) << 8);
+  x = ((x >> 16) & 0x0000FFFF0000FFFFULL) | ((x & 0x0000FFFF0000FFFFULL) << 16);
+  return (x >> 32) | (x << 32);
+}
+
+}  // namespace
+
+bool MaskEngine::run(const FrozenTrie& trie, std::wstring_view s) {
+  size_t len = s.length();
+  size_t num_nodes = trie.nodes.size();
+  _reach.assign(num_nodes, 0);
+  _alive.assign(num_nodes, 0);
+  _hits.clear();
+  // 每个字符出现位置的掩码，字面算子用它按位与求出所有出现位置
+  _char_masks.clear();
+  for (size_t pos = 0; pos < len; ++pos) {
+    _char_masks.emplace_back(s[pos], uint64_t(1) << pos);
+  }
+  std::sort(_char_masks.begin(), _char_masks.end());
+  size_t num_chars = 0;
+  for (auto& item : _char_masks) {
+    if (num_chars > 0 && _char_masks[num_chars - 1].first == item.first) {
+      _char_masks[num_chars - 1].second |= item.second;
+    } else {
+      _char_masks[num_chars++] = item;
+    }
+  }
+  _char_masks.resize(num_chars);
+
+  // 前向：层序编号保证父节点先于子节点
+  _reach[0] = 1;
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    auto& node = trie.nodes[i];
+    if (_reach[i] == 0) {
+      continue;
+    }
+    for (uint32_t child = node.child_begin; child < node.child_end; ++child) {
+      _reach[child] = forward(trie, child, _reach[i], s);
+    }
+  }
+
+  // 收回：倒序处理，子节点先于父节点；子节点也倒序，和_hits的记录顺序对应
+  uint64_t end_bit = uint64_t(1) << len;
+  for (uint32_t i = static_cast<uint32_t>(num_nodes); i-- > 0;) {
+    auto& node = trie.nodes[i];
+    if (_reach[i] == 0) {
+      continue;
+    }
+    uint64_t ok = node.is_end ? end_bit : 0;
+    // 即使子节点不可达也要调用，消费掉它在前向时记录的词典命中
+    for (uint32_t child = node.child_end; child-- > node.child_begin;) {
+      ok |= backward(trie, child, _reach[i], _alive[child], len);
+    }
+    _alive[i] = _reach[i] & ok;
+  }
+  return _alive[0] != 0;
+}
+
+uint64_t MaskEngine::forward(const FrozenTrie& trie, uint32_t node_id, uint64_t from, std::wstring_view s) {
+  auto& node = trie.nodes[node_id];
+  size_t len = s.length();
+  uint64_t valid = len == 63 ? ~uint64_t(0) : (uint64_t(1) << (len + 1)) - 1;
+  uint64_t to = 0;
+  switch (node.kind) {
+    case OpKind::LITERAL: {
+      // 第j个字符出现在p + j，右移j后按位与，得到整个字面的起始位置
+      uint64_t starts = from;
+      for (uint32_t j = 0; j < node.arg_len && starts; ++j) {
+        starts &= char_mask(trie.chars[node.arg + j]) >> j;
+      }
+      to = node.arg_len <= len ? starts << node.arg_len : 0;
+      break;
+    }
+    case OpKind::WILDCARD:
+      for (size_t k = node.min_len; k <= node.max_len && k <= len; ++k) {
+        to |= from << k;
+      }
+      break;
+    case OpKind::DICT: {
+      if (node.min_len > len) {
+        break;
+      }
+      uint64_t min_mask = ~((uint64_t(1) << node.min_len) - 1);
+      for (uint64_t bits = from; bits; bits &= bits - 1) {
+        size_t pos = lowest_bit(bits), depth = 0;
+        uint64_t lengths = trie.dicts[node.arg].prefix_lengths(s, pos, node.max_len, depth) & min_mask;
+        if (lengths) {
+          // 长度不超过len - pos，左移不会越界
+          _hits.push_back({node_id, static_cast<uint32_t>(pos), lengths << pos});
+          to |= lengths << pos;
+        }
+      }
+      break;
+    }
+    case OpKind::ANCHOR_BEGIN:
+      to = from & 1;
+      break;
+    case OpKind::ANCHOR_END:
+      to = from & (uint64_t(1) << len);
+      break;
+    default:
+      break;
+  }
+  // 剩余长度不在子树长度集合里的位置不可能匹配到串尾，提前去掉，减少后续的计算
+  // 串长不超过63，只需要长度集合的第一个字：位置p保留当且仅当len - p在集合中
+  uint64_t fit = reverse_bits(trie.length_words[node.child_lengths]) >> (63 - len);
+  return to & valid & fit;
+}
+
+uint64_t MaskEngine::char_mask(wchar_t ch) const {
+  auto iter = std::lower_bound(_char_masks.begin(), _char_masks.end(), std::make_pair(ch, uint64_t(0)));
+  return (iter != _char_masks.end() && iter->first == ch) ? iter->second : 0;
+}
+
+uint64_t MaskEngine::backward(const FrozenTrie& trie, uint32_t node_id, uint64_t from, uint64_t to, size_t len) {
+  auto& node = trie.nodes[node_id];
+  uint64_t starts = 0;
+  switch (node.kind) {
+    case OpKind::LITERAL:
+      // to里的位置都是从from中某个位置匹配字面得到的，直接移回去即可
+      starts = to >> node.arg_len;
+      break;
+    case OpKind::WILDCARD:
+      for (size_t k = node.min_len; k <= node.max_len && k <= len; ++k) {
+        starts |= to >> k;
+      }
+      break;
+    case OpKind::DICT:
+      while (!_hits.empty() && _hits.back().node == node_id) {
+        auto& hit = _hits.back();
+        if (hit.ends & to) {
+          starts |= uint64_t(1) << hit.pos;
+        }
+        _hits.pop_back();
+      }
+      break;
+    case OpKind::ANCHOR_BEGIN:
+    case OpKind::ANCHOR_END:
+      starts = to;
+      break;
+    default:
+      break;
+  }
+  return starts & from;
+}
+
+}  // namespace optrie
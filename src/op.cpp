@@ -1,30 +1,18 @@
 #include "op.h"
+#include "frozen_trie.h"
 #include "log_utils.h"
 #include "nlohmann/json.hpp"
 
+#include <algorithm>
+
 namespace optrie {
 
+size_t MAX_LEN = 64;
+
 void set_max_match_len(size_t len) {
   MAX_LEN = len;
 }
 
-bool MatchIterator::next(size_t& length) {
-  while ((_len_end - _len_start) * _len_step >= 0) {
-    auto len = _len_start;
-    bool hit = _op->match_next(_s, _pos_start, len);
-    _len_start += _len_step;
-    if (hit) {
-      length = len;
-      return true;
-    }
-  }
-  return false;
-}
-
-void MatchIterator::debug_info() const {
-  LOG_DEBUG("Iterator of op[%s], length range(%ld, %ld, %ld)", _op->expr.c_str(), _len_start, _len_end, _len_step);
-}
-
 bool OpNode::get_child(const std::string& expr, std::shared_ptr<OpNode>& child) const {
   auto iter = _children_map.find(expr);
   if (iter == _children_map.end()) {
@@ -40,22 +28,134 @@ void OpNode::add_child(std::shared_ptr<OpNode> child) {
   _children_map[child->expr] = child;
 }
 
-void OpNode::update_child_min_max_len() {
+LengthSet OpNode::lengths() const {
+  LengthSet result(MAX_LEN);
+  result.set_range(_min_len, _max_len);
+  return result;
+}
+
+void OpNode::remove_child(const std::string& expr) {
+  auto iter = _children_map.find(expr);
+  if (iter == _children_map.end()) {
+    return;
+  }
+  children.erase(std::find(children.begin(), children.end(), iter->second));
+  _children_map.erase(iter);
+}
+
+void OpNode::update_child_min_max_len(bool recursive) {
+  _child_lengths = LengthSet(MAX_LEN);
+  // 没有子节点也不可终止时（模板删光了），子树什么都匹配不了
+  _child_min_len = 1 << 20;
   if (children.size() > 0) {
     // 先更新子节点
-    size_t child_min = 1 << 20, child_max = 0;
+    size_t child_min = 1 << 20;
     for (auto& child : children) {
-      child->update_child_min_max_len();
-      child_max = max(child_max, child->_child_max_len + child->_max_len);
+      if (recursive) {
+        child->update_child_min_max_len();
+      }
       child_min = min(child_min, child->_child_min_len + child->_min_len);
+      // 子节点自身长度和其子树长度的闵可夫斯基和，即经过该子节点能匹配的所有长度
+      _child_lengths |= child->lengths().sum(child->_child_lengths);
     }
-    _child_max_len = min(MAX_LEN, child_max);
+    // 最小长度不截断，子串搜索不受MAX_LEN限制时仍要用到
     _child_min_len = child_min;
   }
   // end可以视为某个特殊的空子节点
   if (is_end) {
     _child_min_len = 0;
+    _child_lengths.set(0);
   }
+  _child_max_len = _child_lengths.max();
+}
+
+void OpNode::merge_child_min_max_len(const OpNode* child) {
+  if (child != nullptr) {
+    _child_min_len = min(_child_min_len, child->_child_min_len + child->_min_len);
+    _child_lengths |= child->lengths().sum(child->_child_lengths);
+  }
+  if (is_end) {
+    _child_min_len = 0;
+    _child_lengths.set(0);
+  }
+  _child_max_len = _child_lengths.max();
+}
+
+void OpNode::update_subtree_max_score(bool recursive) {
+  _subtree_max_score = is_end ? score : -std::numeric_limits<double>::infinity();
+  for (auto& child : children) {
+    if (recursive) {
+      child->update_subtree_max_score();
+    }
+    _subtree_max_score = std::max(_subtree_max_score, child->_subtree_max_score);
+  }
+}
+
+std::vector<std::string> OpNode::set_template(const TemplateEntry& entry) {
+  std::vector<std::string> others;
+  bool replaced = false;
+  for (auto& t : _templates) {
+    if (t.tpl == entry.tpl) {
+      t = entry;
+      replaced = true;
+    } else {
+      others.emplace_back(t.tpl);
+    }
+  }
+  if (!replaced) {
+    _templates.emplace_back(entry);
+  }
+  is_end = true;
+  score = -std::numeric_limits<double>::infinity();
+  for (auto& t : _templates) {
+    score = std::max(score, t.score);
+  }
+  return others;
+}
+
+bool OpNode::erase_template(const std::string& tpl) {
+  auto iter = std::find_if(_templates.begin(), _templates.end(),
+                           [&](const TemplateEntry& t) { return t.tpl == tpl; });
+  if (iter == _templates.end()) {
+    return false;
+  }
+  _templates.erase(iter);
+  is_end = !_templates.empty();
+  score = is_end ? -std::numeric_limits<double>::infinity() : 0.0;
+  for (auto& t : _templates) {
+    score = std::max(score, t.score);
+  }
+  return true;
+}
+
+void OpNode::freeze(FrozenNode& node, FrozenTrieBuilder& builder) const {
+  node.min_len = static_cast<uint32_t>(_min_len);
+  node.max_len = static_cast<uint32_t>(_max_len);
+  node.child_min_len = static_cast<uint32_t>(_child_min_len);
+  node.child_max_len = static_cast<uint32_t>(_child_max_len);
+  node.lengths = builder.add_length_set(lengths());
+  node.child_lengths = builder.add_length_set(_child_lengths);
+  node.arg = 0;
+  node.arg_len = 0;
+  node.tpl_id = 0;
+  node.is_end = is_end;
+  node.literal_indexed = false;
+  node.dispatched = false;
+  node.score = score;
+  node.subtree_max_score = _subtree_max_score;
+  // 同一节点的模板在镜像中连续存放，tpl_id为第一项
+  for (size_t i = 0; i < _templates.size(); ++i) {
+    auto& t = _templates[i];
+    uint32_t tpl_id = builder.add_template(t.tpl, t.score, t.extra, t.extractors, i + 1 < _templates.size());
+    if (i == 0) {
+      node.tpl_id = tpl_id;
+    }
+  }
+}
+
+void RootOpNode::freeze(FrozenNode& node, FrozenTrieBuilder& builder) const {
+  OpNode::freeze(node, builder);
+  node.kind = OpKind::ROOT;
 }
 
 void OpNode::show(size_t depth) const {
@@ -64,13 +164,13 @@ void OpNode::show(size_t depth) const {
   }
   std::cout << expr << " (" << relu(depth - 1) << ")";
   std::cout << "\t[" << _min_len << ", " << _max_len << ", " << _child_min_len << ", " << _child_max_len << ']';
-  if (is_end) {
+  for (auto& t : _templates) {
     std::cout << "\t[END]";
-    if (!_extra.empty()) {
-      std::cout << "\textra:" << nlohmann::json(_extra);
+    if (!t.extra.empty()) {
+      std::cout << "\textra:" << nlohmann::json(t.extra);
     }
-    if (!_extractors.empty()) {
-      std::cout << "\textractors:" << nlohmann::json(_extractors);
+    if (!t.extractors.empty()) {
+      std::cout << "\textractors:" << nlohmann::json(t.extractors);
     }
   }
   std::cout << std::endl;
@@ -1,4 +1,9 @@
-#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <set>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "op_trie.h"
 #include "log_utils.h"
 #include "nlohmann/json.hpp"
@@ -14,63 +19,642 @@ std::shared_ptr<OpNode> OpNodeFactory::get(const std::string& expr) {
     op = std::make_shared<DictOpNode>(expr, *_pat_dic);
   } else if (type == "[W:") {
     op = std::make_shared<WildcardOpNode>(expr);
+  } else if (expr == "[^]" || expr == "[$]") {
+    op = std::make_shared<AnchorOpNode>(expr);
   } else {
     op = std::make_shared<LiteralOpNode>(expr);
   }
   return op;
 }
 
-MatchResult OpTrie::match(const std::wstring& s) const {
+namespace {
+
+// 根据匹配路径构造结果，[begin, end)是匹配的区间
+MatchResult make_result(std::wstring_view s, const FrozenTrie& trie, const FrozenTemplate& tpl,
+                        const std::vector<OpResult>& matched_results, size_t begin, size_t end) {
   MatchResult res;
-  std::vector<OpResult> matched_results;
-  if (match_dfs(_root, s, 0, matched_results)) {
-    // last op
-    auto op = matched_results.back().op;
-    // extra
-    res.extra = op->get_extra();
-    // extractors of last op
-    for (auto& pair : op->get_extractors()) {
-      auto& op_res = matched_results[pair.second];
-      res.groups[pair.first] = s.substr(op_res.start, op_res.length);
-    }
-    res.tpl = op->tpl;
-    res.score = op->score;
-    res.matched = true;
+  res.start = begin;
+  res.end = end;
+  // extra，镜像中已按key排序，依次追加到末尾
+  for (uint32_t i = tpl.extra_begin; i < tpl.extra_end; ++i) {
+    auto& field = trie.fields[i];
+    res.extra.emplace_hint(res.extra.end(), trie.str(field.key, field.key_len),
+                           trie.str(field.value, field.value_len));
+  }
+  // extractors of last op
+  for (uint32_t i = tpl.extractor_begin; i < tpl.extractor_end; ++i) {
+    auto& field = trie.fields[i];
+    auto& op_res = matched_results[field.value];
+    res.groups.emplace_hint(res.groups.end(), trie.str(field.key, field.key_len),
+                            s.substr(op_res.start, op_res.length));
+  }
+  res.tpl = trie.str(tpl.tpl, tpl.tpl_len);
+  res.score = tpl.score;
+  res.matched = true;
+  return res;
+}
+
+// 终止节点上分数最高的模板（同分取先加入的）
+inline const FrozenTemplate& best_template(const FrozenTrie& trie, const FrozenNode& node) {
+  uint32_t best = node.tpl_id;
+  for (uint32_t id = node.tpl_id + 1, end = node.tpl_id + trie.num_templates(node); id < end; ++id) {
+    if (trie.templates[id].score > trie.templates[best].score) {
+      best = id;
+    }
+  }
+  return trie.templates[best];
+}
+
+// 把本次匹配的统计写到结果上（未开启统计时为空操作）
+inline void attach_stats(MatchResult& res) {
+  OPTRIE_STATS(res.stats = match_stats());
+}
+
+inline void attach_stats(std::vector<MatchResult>& results) {
+  for (auto& res : results) {
+    attach_stats(res);
+  }
+}
+
+// 模板统计：到达终止节点时计一次，析构时记下在其子树内的耗时；终止节点上有多个模板时各计一份
+// counters为[counters, counters + n)，n为0时什么都不做
+// kEnabled为false时是空操作，不开启统计的匹配不多任何开销
+template <bool kEnabled>
+class TemplateTimer {
+ public:
+  TemplateTimer(TemplateCounters::Counter* counters, size_t n) {}
+
+  inline void hit() {}
+};
+
+template <>
+class TemplateTimer<true> {
+ public:
+  TemplateTimer(TemplateCounters::Counter* counters, size_t n) : _counters(counters), _n(n) {
+    if (_n > 0) {
+      for (size_t i = 0; i < _n; ++i) {
+        TemplateCounters::add(_counters[i].attempts, 1);
+      }
+      _start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TemplateTimer() {
+    if (_n > 0) {
+      auto elapsed = std::chrono::steady_clock::now() - _start;
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+      for (size_t i = 0; i < _n; ++i) {
+        TemplateCounters::add(_counters[i].time_ns, ns);
+      }
+    }
+  }
+
+  inline void hit() {
+    for (size_t i = 0; i < _n; ++i) {
+      TemplateCounters::add(_counters[i].hits, 1);
+    }
+  }
+
+ private:
+  TemplateCounters::Counter* _counters;
+  size_t _n;
+  std::chrono::steady_clock::time_point _start;
+};
+
+// 单次匹配的预算计数，每展开一个(节点, 起始位置)算一步，每64步看一次时钟
+class BudgetTracker {
+ public:
+  explicit BudgetTracker(const MatchBudget& budget)
+      : _max_steps(budget.max_steps), _check_clock(budget.deadline_us > 0) {
+    if (_check_clock) {
+      _deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budget.deadline_us);
+    }
+  }
+
+  // 再走一步，预算用完时返回true（之后一直返回true）
+  inline bool step() {
+    if (_timed_out) {
+      return true;
+    }
+    ++_steps;
+    if ((_max_steps > 0 && _steps > _max_steps) ||
+        (_check_clock && _steps % 64 == 0 && std::chrono::steady_clock::now() >= _deadline)) {
+      _timed_out = true;
+    }
+    return _timed_out;
+  }
+
+  inline bool timed_out() const {
+    return _timed_out;
+  }
+
+ private:
+  uint64_t _max_steps;
+  bool _check_clock;
+  std::chrono::steady_clock::time_point _deadline;
+  uint64_t _steps = 0;
+  bool _timed_out = false;
+};
+
+// collector约定：
+//    kToEnd: 是否要求匹配到串尾（整串匹配）
+//    accept: 到达可终止节点（pos为当前位置），返回true时结束搜索
+//    prune: 返回true时当前子树不再展开
+//    out_of_budget: 每展开一个节点调用一次，返回true时结束搜索（见CollectorBase）
+
+// 预算：budget为空时不限
+// 字面索引：整串匹配时ROOT下的字面叶子只走literal_hit（字面索引查到的节点，0为没有）
+struct CollectorBase {
+  inline bool out_of_budget() {
+    return budget != nullptr && budget->step();
+  }
+
+  BudgetTracker* budget = nullptr;
+  uint32_t literal_hit = 0;
+};
+
+// 首个匹配：到达可终止节点即结束
+struct FirstMatchCollector : CollectorBase {
+  static constexpr bool kToEnd = true;
+
+  inline bool accept(const FrozenNode& node, const std::vector<OpResult>& matched_results, size_t pos) {
+    found = &node;
+    return true;
+  }
+
+  inline bool prune(const FrozenNode& node) const {
+    return false;
+  }
+
+  const FrozenNode* found = nullptr;
+};
+
+// 最高分匹配：记录分数最高的路径（同分取先找到的），终止节点的分数为其上模板的最高分，
+// 子树最高分不超过当前最优时整棵剪掉
+struct BestMatchCollector : CollectorBase {
+  static constexpr bool kToEnd = true;
+
+  BestMatchCollector(std::vector<OpResult>& best_results) : best_results(best_results) {}
+
+  inline bool accept(const FrozenNode& node, const std::vector<OpResult>& matched_results, size_t pos) {
+    if (best == nullptr || node.score > best->score) {
+      best = &node;
+      best_results = matched_results;
+    }
+    return false;
+  }
+
+  inline bool prune(const FrozenNode& node) const {
+    return best != nullptr && node.subtree_max_score <= best->score;
+  }
+
+  const FrozenNode* best = nullptr;
+  std::vector<OpResult>& best_results;
+};
+
+// 全部匹配：每个可终止节点只会到达一次（memo保证），按找到的先后收集，节点上的每个模板各一个结果
+struct AllMatchCollector : CollectorBase {
+  static constexpr bool kToEnd = true;
+
+  AllMatchCollector(const FrozenTrie& trie, std::wstring_view s) : trie(trie), s(s) {}
+
+  inline bool accept(const FrozenNode& node, const std::vector<OpResult>& matched_results, size_t pos) {
+    for (uint32_t id = node.tpl_id, end = id + trie.num_templates(node); id < end; ++id) {
+      results.emplace_back(make_result(s, trie, trie.templates[id], matched_results, 0, pos));
+    }
+    return false;
+  }
+
+  inline bool prune(const FrozenNode& node) const {
+    return false;
+  }
+
+  const FrozenTrie& trie;
+  std::wstring_view s;
+  std::vector<MatchResult> results;
+};
+
+// top-k匹配：小顶堆保留score最高的k个（同分保留先找到的），
+// 堆满后子树最高分不超过堆顶时整棵剪掉
+struct TopKMatchCollector : CollectorBase {
+  struct Entry {
+    double score;
+    size_t order;  // 找到的先后
+    MatchResult res;
+  };
+
+  // 堆顶是最差的：分数最低，同分时最晚找到
+  static bool better(const Entry& x, const Entry& y) {
+    return x.score > y.score || (x.score == y.score && x.order < y.order);
+  }
+
+  static constexpr bool kToEnd = true;
+
+  TopKMatchCollector(const FrozenTrie& trie, std::wstring_view s, size_t k)
+      : trie(trie), s(s), k(k) {}
+
+  // 节点上的每个模板各算一个结果
+  inline bool accept(const FrozenNode& node, const std::vector<OpResult>& matched_results, size_t pos) {
+    for (uint32_t id = node.tpl_id, end = id + trie.num_templates(node); id < end; ++id) {
+      auto& tpl = trie.templates[id];
+      if (heap.size() < k) {
+        heap.push_back({tpl.score, found++, make_result(s, trie, tpl, matched_results, 0, pos)});
+        std::push_heap(heap.begin(), heap.end(), better);
+      } else if (k > 0 && tpl.score > heap.front().score) {
+        std::pop_heap(heap.begin(), heap.end(), better);
+        heap.back() = {tpl.score, found++, make_result(s, trie, tpl, matched_results, 0, pos)};
+        std::push_heap(heap.begin(), heap.end(), better);
+      }
+    }
+    return false;
+  }
+
+  inline bool prune(const FrozenNode& node) const {
+    return k > 0 && heap.size() == k && node.subtree_max_score <= heap.front().score;
+  }
+
+  const FrozenTrie& trie;
+  std::wstring_view s;
+  size_t k;
+  size_t found = 0;
+  std::vector<Entry> heap;
+};
+
+// 子串搜索：从begin开始，任意位置到达可终止节点都记为一次出现
+// 同一起始位置下每个(可终止节点, 结束位置)只会到达一次（memo保证），节点上的每个模板各记一次
+struct SearchCollector : CollectorBase {
+  static constexpr bool kToEnd = false;
+
+  SearchCollector(const FrozenTrie& trie, std::wstring_view s) : trie(trie), s(s) {}
+
+  inline bool accept(const FrozenNode& node, const std::vector<OpResult>& matched_results, size_t pos) {
+    for (uint32_t id = node.tpl_id, end = id + trie.num_templates(node); id < end; ++id) {
+      results.emplace_back(make_result(s, trie, trie.templates[id], matched_results, begin, pos));
+    }
+    return false;
+  }
+
+  inline bool prune(const FrozenNode& node) const {
+    return false;
+  }
+
+  const FrozenTrie& trie;
+  std::wstring_view s;
+  size_t begin = 0;
+  std::vector<MatchResult> results;
+};
+
+// explain用的回溯，和match_dfs的首个匹配模式一致，记录每一步
+// 返回是否匹配成功，step为当前展开在out.steps中的下标
+bool explain_dfs(const FrozenTrie& trie, std::wstring_view s, size_t step, size_t pos,
+                 std::vector<OpResult>& matched_results, FailMemo& memo, ExplainResult& out) {
+  uint32_t node_id = out.steps[step].node;
+  auto& cur_node = trie.nodes[node_id];
+  if (cur_node.is_end) {
+    auto& tpl = trie.templates[cur_node.tpl_id];
+    out.steps[step].tpl = trie.str(tpl.tpl, tpl.tpl_len);
+  }
+  bool found = false;
+  if (memo.test(node_id, pos)) {
+    out.steps[step].memo_hit = true;
+  } else if (cur_node.is_end && pos == s.length()) {
+    out.steps[step].accepted = true;
+    found = true;
+  } else {
+    out.steps[step].fits_children = trie.can_fit_in_children(cur_node, s.length() - pos, true);
+    if (out.steps[step].fits_children) {
+      for (uint32_t child = cur_node.child_begin; child < cur_node.child_end && !found; ++child) {
+        // steps会扩容，不能持有引用
+        size_t cand = out.steps[step].candidates.size();
+        out.steps[step].candidates.push_back({child, std::string(trie.expr(child)), {}});
+        MatchIterator iter(trie, trie.nodes[child], s, pos, true);
+        size_t matched_length;
+        while (!found && iter.next(matched_length)) {
+          out.steps[step].candidates[cand].lengths.emplace_back(matched_length);
+          ExplainStep child_step;
+          child_step.parent = static_cast<int64_t>(step);
+          child_step.node = child;
+          child_step.expr = trie.expr(child);
+          child_step.depth = out.steps[step].depth + 1;
+          child_step.start = pos;
+          child_step.length = matched_length;
+          size_t child_index = out.steps.size();
+          out.steps.emplace_back(std::move(child_step));
+          matched_results.emplace_back(pos, matched_length, child);
+          if (explain_dfs(trie, s, child_index, pos + matched_length, matched_results, memo, out)) {
+            found = true;
+          } else {
+            matched_results.pop_back();
+            out.steps[child_index].backtracked = true;
+          }
+        }
+      }
+    }
+    if (!found) {
+      memo.set(node_id, pos);
+    }
+  }
+  out.steps[step].cost = out.steps.size() - step;
+  return found;
+}
+
+}  // namespace
+
+OpTrie& OpTrie::set_engine(MatchEngine engine) {
+  _engine = engine;
+  return *this;
+}
+
+template <class Collector>
+void OpTrie::match_to_end(const FrozenTrie& trie, std::wstring_view s,
+                          std::vector<OpResult>& matched_results, Collector& collector) const {
+  // 每个线程复用同一个缓冲，匹配过程不再分配内存
+  thread_local FailMemo memo;
+  thread_local MaskEngine mask_engine;
+  OPTRIE_STATS(match_stats() = MatchStats());
+  matched_results.clear();
+  // 超出树能匹配长度的串直接返回，也避免按超长串分配memo
+  if (!trie.can_fit_in_children(trie.nodes[0], s.length(), true)) {
+    return;
+  }
+  memo.reset(trie.nodes.size(), s.length());
+  auto counters = template_counters(trie);
+  // 整串等于某个字面模板时由字面索引直接查到，其余字面叶子不用逐个比较
+  const FrozenLiteral* literal = trie.find_literal(s);
+  collector.literal_hit = literal != nullptr ? literal->node : 0;
+  // 它之前没有其他ROOT子节点时先走它，和按顺序回溯的结果一致，首个匹配不用再回溯
+  if (literal != nullptr && literal->prior == 0) {
+    matched_results.emplace_back(0, s.length(), literal->node);
+    bool done = counters != nullptr
+        ? match_dfs<Collector, true>(trie, literal->node, s, s.length(), matched_results, memo, collector,
+                                     nullptr, counters)
+        : match_dfs(trie, literal->node, s, s.length(), matched_results, memo, collector, nullptr, nullptr);
+    if (done) {
+      return;
+    }
+    matched_results.pop_back();
+    collector.literal_hit = 0;
+  }
+  const MaskEngine* guide = nullptr;
+  if (_engine == MatchEngine::BITMASK && s.length() <= MaskEngine::MAX_QUERY_LEN) {
+    if (!mask_engine.run(trie, s)) {
+      return;
+    }
+    guide = &mask_engine;
+  }
+  if (counters != nullptr) {
+    match_dfs<Collector, true>(trie, 0, s, 0, matched_results, memo, collector, guide, counters);
+  } else {
+    match_dfs(trie, 0, s, 0, matched_results, memo, collector, guide, nullptr);
+  }
+}
+
+MatchResult OpTrie::match(std::wstring_view s) const {
+  auto frozen = _frozen.read();
+  return match(*frozen, s, MatchBudget());
+}
+
+MatchResult OpTrie::match(std::wstring_view s, const MatchBudget& budget) const {
+  auto frozen = _frozen.read();
+  return match(*frozen, s, budget);
+}
+
+MatchResult OpTrie::match(const FrozenTrie& trie, std::wstring_view s, const MatchBudget& budget) const {
+  thread_local std::vector<OpResult> matched_results;
+  FirstMatchCollector collector;
+  BudgetTracker tracker(budget);
+  if (!budget.unlimited()) {
+    collector.budget = &tracker;
+  }
+  match_to_end(trie, s, matched_results, collector);
+  MatchResult res;
+  // 预算用完时found仍为空
+  if (collector.found != nullptr) {
+    res = make_result(s, trie, trie.templates[collector.found->tpl_id], matched_results, 0, s.length());
   } else {
     res.matched = false;
   }
+  res.timed_out = tracker.timed_out();
+  attach_stats(res);
   return res;
 }
 
-bool OpTrie::match_dfs(std::shared_ptr<OpNode> cur_node, const std::wstring& s, size_t start,
-                       std::vector<OpResult>& matched_results) const {
+MatchResult OpTrie::match_best(std::wstring_view s) const {
+  return match_best(s, MatchBudget());
+}
+
+MatchResult OpTrie::match_best(std::wstring_view s, const MatchBudget& budget) const {
+  thread_local std::vector<OpResult> matched_results;
+  thread_local std::vector<OpResult> best_results;
+  auto frozen = _frozen.read();
+  const FrozenTrie& trie = *frozen;
+  BestMatchCollector collector(best_results);
+  BudgetTracker tracker(budget);
+  if (!budget.unlimited()) {
+    collector.budget = &tracker;
+  }
+  match_to_end(trie, s, matched_results, collector);
+  MatchResult res;
+  if (collector.best != nullptr) {
+    res = make_result(s, trie, best_template(trie, *collector.best), best_results, 0, s.length());
+  } else {
+    res.matched = false;
+  }
+  res.timed_out = tracker.timed_out();
+  attach_stats(res);
+  return res;
+}
+
+std::vector<MatchResult> OpTrie::match_batch(const std::vector<std::wstring>& strs,
+                                             size_t num_threads, const MatchBudget& budget) const {
+  // 每次从队列里取一小段，兼顾负载均衡和原子计数的开销
+  const static size_t BATCH_CHUNK_SIZE = 64;
+  std::vector<MatchResult> results(strs.size());
+  size_t num_chunks = (strs.size() + BATCH_CHUNK_SIZE - 1) / BATCH_CHUNK_SIZE;
+  // 整批使用同一个快照，由当前线程持有，工作线程结束前不会被释放
+  auto frozen = _frozen.read();
+  const FrozenTrie& trie = *frozen;
+  parallel_for(num_chunks, [&](size_t chunk) {
+    size_t begin = chunk * BATCH_CHUNK_SIZE;
+    size_t end = min(begin + BATCH_CHUNK_SIZE, strs.size());
+    for (size_t i = begin; i < end; ++i) {
+      results[i] = match(trie, strs[i], budget);
+    }
+  }, num_threads);
+  return results;
+}
+
+std::vector<MatchResult> OpTrie::match_all(std::wstring_view s) const {
+  thread_local std::vector<OpResult> matched_results;
+  auto frozen = _frozen.read();
+  const FrozenTrie& trie = *frozen;
+  AllMatchCollector collector(trie, s);
+  match_to_end(trie, s, matched_results, collector);
+  attach_stats(collector.results);
+  return std::move(collector.results);
+}
+
+std::vector<MatchResult> OpTrie::match_topk(std::wstring_view s, size_t k) const {
+  thread_local std::vector<OpResult> matched_results;
+  auto frozen = _frozen.read();
+  const FrozenTrie& trie = *frozen;
+  TopKMatchCollector collector(trie, s, k);
+  OPTRIE_STATS(match_stats() = MatchStats());
+  if (k > 0) {
+    match_to_end(trie, s, matched_results, collector);
+  }
+  std::sort_heap(collector.heap.begin(), collector.heap.end(), TopKMatchCollector::better);
+  std::vector<MatchResult> results;
+  results.reserve(collector.heap.size());
+  for (auto& entry : collector.heap) {
+    results.emplace_back(std::move(entry.res));
+  }
+  attach_stats(results);
+  return results;
+}
+
+std::vector<MatchResult> OpTrie::search(std::wstring_view s) const {
+  thread_local std::vector<OpResult> matched_results;
+  thread_local SearchMemo memo;
+  auto frozen = _frozen.read();
+  const FrozenTrie& trie = *frozen;
+  SearchCollector collector(trie, s);
+  auto counters = template_counters(trie);
+  OPTRIE_STATS(match_stats() = MatchStats());
+  // 一次扫描：子树里没有出现的(节点, 位置)和起始位置无关，各起始位置共用memo，
+  // 窗口覆盖从一个起始位置最远能到的位置，不随文本长度增长
+  memo.reset(trie.nodes.size(), std::min(trie.max_span, s.length()) + 1);
+  for (size_t begin = 0; begin <= s.length(); ++begin) {
+    // 剩余长度放不下任何模板时，后面的起始位置也不可能了
+    if (!trie.nodes[0].can_fit_in_children(s.length() - begin, false)) {
+      break;
+    }
+    matched_results.clear();
+    memo.advance(begin);
+    collector.begin = begin;
+    if (counters != nullptr) {
+      match_dfs<SearchCollector, true>(trie, 0, s, begin, matched_results, memo, collector, nullptr, counters);
+    } else {
+      match_dfs(trie, 0, s, begin, matched_results, memo, collector, nullptr, nullptr);
+    }
+  }
+  attach_stats(collector.results);
+  return std::move(collector.results);
+}
+
+template <class Collector, bool kTemplateStats, class Memo>
+bool OpTrie::match_dfs(const FrozenTrie& trie, uint32_t node_id, std::wstring_view s, size_t start,
+                       std::vector<OpResult>& matched_results, Memo& memo,
+                       Collector& collector, const MaskEngine* guide,
+                       TemplateCounters::Counter* counters) const {
   // assert(start <= s.length());
-  if (start == s.length() && cur_node->is_end) {
+  // 每个(节点, 起始位置)只展开一次：首个匹配模式下再次到达必然失败，
+  // 其他模式下再次到达也只会得到相同的可终止节点
+  if (memo.test(node_id, start)) {
+    OPTRIE_STATS(++match_stats().memo_hits);
+    return false;
+  }
+  if (collector.out_of_budget()) {
     return true;
   }
-  if (cur_node->can_fit_in_children(s.length() - start)) {
-    for (auto& child : cur_node->children) {
-      auto iter = child->match(s, start);
-      // iter.debug();
+  OPTRIE_STATS(++match_stats().nodes_visited);
+  OPTRIE_STATS(match_stats().max_depth = std::max<uint64_t>(match_stats().max_depth, matched_results.size()));
+  auto& cur_node = trie.nodes[node_id];
+  TemplateTimer<kTemplateStats> timer(kTemplateStats ? &counters[cur_node.tpl_id] : nullptr,
+                                      kTemplateStats ? trie.num_templates(cur_node) : 0);
+  size_t mark = memo.enter();
+  if (cur_node.is_end && (!Collector::kToEnd || start == s.length())) {
+    timer.hit();
+    memo.hit();
+    if (collector.accept(cur_node, matched_results, start)) {
+      return true;
+    }
+  }
+  if (!collector.prune(cur_node) && trie.can_fit_in_children(cur_node, s.length() - start, Collector::kToEnd)) {
+    // 尝试一个子节点的所有匹配长度，返回true时结束搜索
+    auto match_child = [&](uint32_t child) {
+      MatchIterator iter(trie, trie.nodes[child], s, start, Collector::kToEnd);
+      // iter.debug_info();
       size_t matched_length;
       while (iter.next(matched_length)) {
         // LOG_DEBUG("Itering, matched_length: %zu ", matched_length);
-        matched_results.emplace_back(start, matched_length, child.get());
-        if (match_dfs(child, s, start + matched_length, matched_results)) {
+        if (guide != nullptr && !guide->alive(child, start + matched_length)) {
+          continue;
+        }
+        matched_results.emplace_back(start, matched_length, child);
+        if (match_dfs<Collector, kTemplateStats, Memo>(trie, child, s, start + matched_length, matched_results,
+                                                       memo, collector, guide, counters)) {
           return true;
         }
         matched_results.pop_back();
+        OPTRIE_STATS(++match_stats().backtracks);
+      }
+      return false;
+    };
+    if (cur_node.dispatched) {
+      // 子节点多时按下一个字符分派，只尝试首字符对得上的
+      ChildCursor cursor(trie, node_id, s, start, Collector::kToEnd, collector.literal_hit);
+      uint32_t child;
+      while (cursor.next(child)) {
+        // 有位并行结果时，只走之后必然能匹配到串尾的分支
+        if ((guide == nullptr || !guide->dead(child)) && match_child(child)) {
+          return true;
+        }
+      }
+    } else {
+      for (uint32_t child = cur_node.child_begin; child < cur_node.child_end; ++child) {
+        if (guide != nullptr && guide->dead(child)) {
+          continue;
+        }
+        // 整串匹配时字面叶子只可能是字面索引查到的那个
+        if (Collector::kToEnd && trie.nodes[child].literal_indexed && child != collector.literal_hit) {
+          continue;
+        }
+        if (match_child(child)) {
+          return true;
+        }
       }
     }
   }
+  memo.leave(node_id, start, mark);
   return false;
 }
 
+ExplainResult OpTrie::explain(std::wstring_view s) const {
+  auto frozen = _frozen.read();
+  const FrozenTrie& trie = *frozen;
+  ExplainResult out;
+  out.result.matched = false;
+  ExplainStep root;
+  root.expr = trie.expr(0);
+  out.steps.emplace_back(std::move(root));
+  // 超出树能匹配长度的串在ROOT就剪掉
+  if (!trie.can_fit_in_children(trie.nodes[0], s.length(), true)) {
+    out.steps[0].cost = 1;
+    return out;
+  }
+  std::vector<OpResult> matched_results;
+  FailMemo memo;
+  memo.reset(trie.nodes.size(), s.length());
+  if (explain_dfs(trie, s, 0, 0, matched_results, memo, out)) {
+    // 匹配路径的最后一个节点即可终止节点
+    auto& end_node = trie.nodes[matched_results.back().node];
+    out.result = make_result(s, trie, trie.templates[end_node.tpl_id], matched_results, 0, s.length());
+  }
+  return out;
+}
+
 OpTrie& OpTrie::load(const std::vector<std::string>& template_files,
                      const std::vector<std::string>& dict_files) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  check_writable();
   load_pat_dict(dict_files);
+  if (!dict_files.empty()) {
+    refresh_nodes();
+  }
   load_templates(template_files);
   optimize();
+  freeze();
   return *this;
 }
 
@@ -78,6 +662,18 @@ void OpTrie::load_pat_dict(const std::vector<std::string>& dict_files) {
   _pat_dic->load(dict_files);
 }
 
+void OpTrie::refresh_nodes() {
+  std::vector<OpNode*> stack{_root.get()};
+  while (!stack.empty()) {
+    auto op = stack.back();
+    stack.pop_back();
+    op->refresh();
+    for (auto& child : op->children) {
+      stack.emplace_back(child.get());
+    }
+  }
+}
+
 // 切分模板字符串，每个部分是"[]"包住，或者常量字符串
 bool split_tpl(std::string& tpl, std::vector<std::string>& result) {
   result.clear();
@@ -132,19 +728,74 @@ bool split_tpl(std::string& tpl, std::vector<std::string>& result) {
 }
 
 
-void parse_template(std::string& tpl, std::vector<std::string>& exprs,
-                    const std::string& score_str, double& score,
-                    const std::string& extra_str, std::map<std::string, std::string>& extra,
-                    const std::string& extractor_str, std::map<std::string, size_t>& extractors) {
-  // 1. 拆模板到节点表达式
-  auto split_succ = split_tpl(tpl, exprs);
+// 模板项拆为节点表达式（含首尾锚点）
+void parse_exprs(const std::string& tpl, std::vector<std::string>& exprs) {
+  // 1. 拆模板到节点表达式，锚点[^]、[$]和其他算子一样是方括号项，裸的^、$是普通字符
+  std::string body = tpl;
+  auto split_succ = split_tpl(body, exprs);
   if (!split_succ) {
     throw std::runtime_error("Invalid template: " + tpl);
   }
-   // 限制递归匹配深度
-  if (exprs.size() > MAX_MATCH_DEPTH) {
+  // 锚点只能在开头（[^]）或结尾（[$]）
+  size_t num_anchors = 0;
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    bool at_begin = exprs[i] == "[^]", at_end = exprs[i] == "[$]";
+    if ((at_begin && i != 0) || (at_end && i + 1 != exprs.size())) {
+      throw std::runtime_error("Invalid template: " + tpl + ", anchors must be at the ends");
+    }
+    num_anchors += at_begin || at_end;
+  }
+  // 限制递归匹配深度（锚点不计）
+  if (exprs.size() - num_anchors > MAX_MATCH_DEPTH) {
     throw std::runtime_error("Invalid template: " + tpl);
   }
+}
+
+// 规范化节点表达式，等价的模板规范化后共用树中的节点：
+// 模糊匹配统一写成[W:min-max]，相邻的模糊匹配合并为一个（长度范围相加），少一层回溯；
+// 被抽取的模糊匹配不参与合并，保证抽取的片段不变。extractors中的节点下标随之调整
+// 注意：共用节点会改变首个匹配的先后，顺序由共用节点首次出现的位置决定，而不是各模板自己的加载顺序
+void normalize_exprs(std::vector<std::string>& exprs, std::map<std::string, size_t>& extractors) {
+  std::set<size_t> extracted;
+  for (auto& kv : extractors) {
+    extracted.insert(kv.second);
+  }
+  std::vector<std::string> result;
+  std::vector<size_t> new_index(exprs.size());
+  bool mergeable = false;  // result的最后一项是否是可以合并的模糊匹配
+  size_t merged_min = 0, merged_max = 0;
+  for (size_t i = 0; i < exprs.size(); ++i) {
+    if (exprs[i].compare(0, 3, "[W:") == 0) {
+      size_t min_len, max_len;
+      WildcardOpNode::parse_range(exprs[i], min_len, max_len);
+      bool can_merge = extracted.count(i) == 0;
+      if (mergeable && can_merge) {
+        merged_min += min_len;
+        merged_max += max_len;
+        result.back() = WildcardOpNode::canonical_expr(merged_min, merged_max);
+      } else {
+        merged_min = min_len;
+        merged_max = max_len;
+        result.emplace_back(WildcardOpNode::canonical_expr(min_len, max_len));
+      }
+      mergeable = can_merge;
+    } else {
+      result.emplace_back(exprs[i]);
+      mergeable = false;
+    }
+    new_index[i] = result.size() - 1;
+  }
+  for (auto& kv : extractors) {
+    kv.second = new_index[kv.second];
+  }
+  exprs.swap(result);
+}
+
+void parse_template(const std::string& tpl, std::vector<std::string>& exprs,
+                    const std::string& score_str, double& score,
+                    const std::string& extra_str, std::map<std::string, std::string>& extra,
+                    const std::string& extractor_str, std::map<std::string, size_t>& extractors) {
+  parse_exprs(tpl, exprs);
   // 2. 解析score
   try {
     score = std::stod(score_str);
@@ -211,66 +862,404 @@ void parse_template(std::string& tpl, std::vector<std::string>& exprs,
       throw std::runtime_error("Invalid template extractor: '" + extractor_str + "', " + e.what());
     }
   }
+  // 5. 规范化（抽取项按模板中的原始写法找，之后再调整下标）
+  normalize_exprs(exprs, extractors);
 }
 
-void OpTrie::load_templates(const std::vector<std::string>& template_files) {
-  OpNodeFactory op_factory(_pat_dic);
-  std::ifstream fi;
-  std::string line;
+// 解析一行模板（tab分隔，已去掉首尾空白），格式不对时抛异常
+void parse_template_line(const std::string& line, ParsedTemplate& parsed) {
   std::vector<std::string> fields;
+  split(line, '\t', fields);
+  if (fields.size() < 2 || fields.size() > 4) {
+    throw std::runtime_error("wrong number of fields");
+  }
+  parsed.tpl = fields[0];
+  parse_template(fields[0], parsed.exprs,
+                 fields[1], parsed.score,
+                 (fields.size() > 2 ? fields[2] : ""), parsed.extra,
+                 (fields.size() > 3 ? fields[3] : ""), parsed.extractors);
+}
+
+// 把模板文本拆成行，去掉首尾空白，跳过空行和注释
+void split_template_lines(std::string_view text, std::vector<std::string>& lines) {
+  while (!text.empty()) {
+    size_t end = text.find('\n');
+    auto line = trim_view(text.substr(0, end));
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    if (!line.empty() && line[0] != '#') {
+      lines.emplace_back(line);
+    }
+  }
+}
+
+void OpTrie::load_templates(const std::vector<std::string>& template_files) {
   for (auto& template_file : template_files) {
-    fi.open(template_file);
-    if (!fi.is_open()) {
+    std::string content;
+    if (!read_file(template_file, content)) {
       throw std::runtime_error("failed to open template file: " + template_file);
     }
-    while (std::getline(fi, line)) {
-      line = trim(line);
-      if (line.empty() || line[0] == '#') {
-        continue;
-      }
-      split(line, '\t', fields);
-      if (fields.size() < 2 || fields.size() > 4) {
-        LOG_WARN("Invalid template line: %s", line.c_str());
-      }
-      std::vector<std::string> exprs;
-      double score;
-      std::map<std::string, std::string> extra;
-      std::map<std::string, size_t> extractors;
+    std::vector<std::string> lines;
+    split_template_lines(content, lines);
+    insert_template_lines(lines);
+    LOG_INFO("Parse template %s done", template_file.c_str());
+  }
+}
+
+void OpTrie::insert_template_lines(const std::vector<std::string>& lines) {
+  // 并行解析时每个任务的行数
+  const static size_t TEMPLATE_CHUNK_SIZE = 256;
+  // 解析可以并行，接入树必须按行的顺序（决定首个匹配的优先级）
+  std::vector<ParsedTemplate> parsed(lines.size());
+  std::vector<std::string> errors(lines.size());
+  parallel_for((lines.size() + TEMPLATE_CHUNK_SIZE - 1) / TEMPLATE_CHUNK_SIZE, [&](size_t chunk) {
+    size_t end = min((chunk + 1) * TEMPLATE_CHUNK_SIZE, lines.size());
+    for (size_t i = chunk * TEMPLATE_CHUNK_SIZE; i < end; ++i) {
       try {
-        parse_template(fields[0], exprs,
-                       fields[1], score,
-                       (fields.size() > 2 ? fields[2] : ""), extra,
-                       (fields.size() > 3 ? fields[3] : ""), extractors);
+        parse_template_line(lines[i], parsed[i]);
       } catch (const std::exception& e) {
-        LOG_WARN("Failed to parse template line, %s", e.what());
+        errors[i] = e.what();
       }
+    }
+  });
+  for (size_t i = 0; i < lines.size(); ++i) {
+    if (errors[i].empty()) {
+      insert_template(parsed[i]);
+    } else {
+      LOG_WARN("Invalid template line: %s, %s", lines[i].c_str(), errors[i].c_str());
+    }
+  }
+}
+
+OpTrie& OpTrie::load_from_memory(const std::vector<std::string>& template_lines,
+                                 const std::map<std::string, std::vector<std::string>>& dicts) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  check_writable();
+  _pat_dic->load(dicts);
+  if (!dicts.empty()) {
+    refresh_nodes();
+  }
+  std::vector<std::string> lines;
+  for (auto& line : template_lines) {
+    split_template_lines(line, lines);
+  }
+  insert_template_lines(lines);
+  optimize();
+  freeze();
+  return *this;
+}
+
+OpTrie& OpTrie::load_from_text(std::string_view template_text, std::string_view dict_text) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  check_writable();
+  _pat_dic->load_text(dict_text);
+  if (!dict_text.empty()) {
+    refresh_nodes();
+  }
+  std::vector<std::string> lines;
+  split_template_lines(template_text, lines);
+  insert_template_lines(lines);
+  optimize();
+  freeze();
+  return *this;
+}
+
+OpNode* OpTrie::insert_template(const ParsedTemplate& parsed) {
+  OpNodeFactory op_factory(_pat_dic);
+  std::shared_ptr<OpNode> op{_root}, next_op{nullptr};
+  for (auto& expr : parsed.exprs) {
+    if (!op->get_child(expr, next_op)) {
+      next_op = op_factory.get(expr);
+      next_op->set_parent(op);
+      op->add_child(next_op);
+    }
+    op = next_op;
+  }
+  // last op
+  // 规范化后等价的不同模板项共用终止节点，各自保留（match_all等都会给出），但首个匹配只给出先加入的
+  for (auto& other : op->set_template({parsed.tpl, parsed.score, parsed.extra, parsed.extractors})) {
+    LOG_WARN("Template %s is equivalent to %s after normalization, match() only returns the earlier one",
+             parsed.tpl.c_str(), other.c_str());
+  }
+  // 同一模板项换了抽取项时路径可能不同，后加载的覆盖先加载的：从原来的终止节点上去掉
+  // （新节点已是终止节点，剪枝不会剪到它）
+  auto& end = _ends[parsed.tpl];
+  if (end != nullptr && end != op.get()) {
+    erase_end(end, parsed.tpl);
+  }
+  end = op.get();
+  return op.get();
+}
+
+OpTrie& OpTrie::add_template(const std::string& line) {
+  return add_templates({line});
+}
 
-      std::shared_ptr<OpNode> op{_root}, next_op{nullptr};
-      for (auto& expr : exprs) {
-        if (!op->get_child(expr, next_op)) {
-          next_op = op_factory.get(expr);
-          next_op->set_parent(op);
-          op->add_child(next_op);
+OpTrie& OpTrie::add_templates(const std::vector<std::string>& lines) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  check_writable();
+  // 先全部解析，有格式错误时不修改树
+  std::vector<ParsedTemplate> parsed(lines.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    try {
+      parse_template_line(trim(lines[i]), parsed[i]);
+      // 用到的词典必须存在
+      for (auto& expr : parsed[i].exprs) {
+        if (expr.compare(0, 3, "[D:") == 0) {
+          std::shared_ptr<const DictTrie> dict;
+          LengthSet lengths;
+          _pat_dic->get(expr, dict, lengths);
         }
-        op = next_op;
       }
-      // last op
-      op->is_end = true;
-      op->score = score;
-      op->tpl = fields[0];
-      op->set_extra(extra);
-      op->set_extractors(extractors);
+    } catch (const std::exception& e) {
+      throw std::runtime_error("Invalid template line: " + lines[i] + ", " + e.what());
     }
-    LOG_INFO("Parse template %s done", template_file.c_str());
-    fi.close();
+  }
+  for (auto& tpl : parsed) {
+    update_path(insert_template(tpl), true);
+  }
+  freeze();
+  return *this;
+}
+
+bool OpTrie::remove_template(const std::string& tpl) {
+  return remove_templates({tpl}) > 0;
+}
+
+size_t OpTrie::remove_templates(const std::vector<std::string>& tpls) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  check_writable();
+  size_t removed = erase_templates(tpls);
+  if (removed > 0) {
+    freeze();
+  }
+  return removed;
+}
+
+size_t OpTrie::erase_templates(const std::vector<std::string>& tpls) {
+  size_t removed = 0;
+  for (auto& tpl : tpls) {
+    auto iter = _ends.find(tpl);
+    if (iter == _ends.end()) {
+      continue;
+    }
+    erase_end(iter->second, tpl);
+    _ends.erase(iter);
+    ++removed;
+  }
+  return removed;
+}
+
+void OpTrie::erase_end(OpNode* op, const std::string& tpl) {
+  op->erase_template(tpl);
+  // 剪掉不再有模板经过的分支（不会剪到其他模板的终止节点，包括仍终止于op的等价模板）
+  OpNode* cur = op;
+  while (cur != _root.get() && !cur->is_end && cur->children.empty()) {
+    auto parent = cur->parent();
+    parent->remove_child(cur->expr);
+    cur = parent;
+  }
+  update_path(cur, false);
+}
+
+void OpTrie::update_path(OpNode* op, bool grow) {
+  const OpNode* child = nullptr;
+  for (; op != nullptr; child = op, op = op->parent()) {
+    if (grow) {
+      op->merge_child_min_max_len(child);
+    } else {
+      op->update_child_min_max_len(false);
+    }
+    // 分数可能变低（覆盖已有模板），总是重算
+    op->update_subtree_max_score(false);
   }
 }
 
 void OpTrie::optimize() {
   _root->update_child_min_max_len();
+  _root->update_subtree_max_score();
+}
+
+void OpTrie::freeze() {
+  auto frozen = build_frozen();
+  if (_max_template_cost > 0) {
+    std::vector<std::string> rejected;
+    for (auto& c : analyze_templates(*frozen)) {
+      if (c.cost > _max_template_cost) {
+        LOG_WARN("Template too costly: %s, cost %.0f > %.0f", c.tpl.c_str(), c.cost, _max_template_cost);
+        rejected.emplace_back(c.tpl);
+      }
+    }
+    if (erase_templates(rejected) > 0) {
+      frozen = build_frozen();
+    }
+  }
+  publish(std::move(frozen));
+}
+
+std::unique_ptr<FrozenTrie> OpTrie::build_frozen() const {
+  FrozenTrieBuilder builder;
+  // 层序遍历，保证同一节点的子节点在数组里连续
+  std::vector<const OpNode*> queue{_root.get()};
+  for (size_t i = 0; i < queue.size(); ++i) {
+    for (auto& child : queue[i]->children) {
+      queue.emplace_back(child.get());
+    }
+  }
+  builder.nodes.resize(queue.size());
+  uint32_t child_begin = 1;
+  for (size_t i = 0; i < queue.size(); ++i) {
+    auto op = queue[i];
+    auto& node = builder.nodes[i];
+    op->freeze(node, builder);
+    builder.node_exprs.emplace_back(builder.add_string(op->expr));
+    node.child_begin = child_begin;
+    child_begin += static_cast<uint32_t>(op->children.size());
+    node.child_end = child_begin;
+  }
+  builder.index_literals();
+  builder.index_children();
+  return builder.build();
+}
+
+void OpTrie::publish(std::unique_ptr<const FrozenTrie> trie) {
+  std::lock_guard<std::mutex> lock(_stats_mutex);
+  std::shared_ptr<TemplateCounters> counters;
+  std::vector<std::string> tpls;
+  {
+    // 旧快照在publish中释放，先记下计数对应的模板项；读guard要在publish之前释放
+    auto frozen = _frozen.read();
+    if (frozen.get() != nullptr && (_template_stats || frozen->template_counters->active())) {
+      counters = frozen->template_counters;
+      for (auto& tpl : frozen->templates) {
+        tpls.emplace_back(frozen->str(tpl.tpl, tpl.tpl_len));
+      }
+    }
+  }
+  _frozen.publish(std::move(trie));
+  // publish返回后旧快照上的匹配都已结束，计数不会再变
+  if (counters != nullptr && counters->active()) {
+    auto totals = counters->collect();
+    for (size_t i = 0; i < tpls.size(); ++i) {
+      if (totals[i].attempts > 0) {
+        _retired_stats[tpls[i]] += totals[i];
+      }
+    }
+  }
+}
+
+TemplateCounters::Counter* OpTrie::template_counters(const FrozenTrie& trie) const {
+  if (!_template_stats.load(std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  return trie.template_counters->shard();
+}
+
+std::vector<TemplateCost> OpTrie::analyze(size_t top_k) const {
+  auto frozen = _frozen.read();
+  auto costs = analyze_templates(*frozen);
+  std::stable_sort(costs.begin(), costs.end(), [](const TemplateCost& x, const TemplateCost& y) {
+    return x.cost > y.cost || (x.cost == y.cost && x.branching > y.branching);
+  });
+  if (top_k > 0 && costs.size() > top_k) {
+    costs.resize(top_k);
+  }
+  return costs;
+}
+
+std::vector<SubtreeCost> OpTrie::analyze_subtrees(size_t top_k) const {
+  auto frozen = _frozen.read();
+  auto costs = optrie::analyze_subtrees(*frozen);
+  std::stable_sort(costs.begin(), costs.end(), [](const SubtreeCost& x, const SubtreeCost& y) {
+    return x.cost > y.cost;
+  });
+  if (top_k > 0 && costs.size() > top_k) {
+    costs.resize(top_k);
+  }
+  return costs;
+}
+
+OpTrie& OpTrie::set_max_template_cost(double max_cost) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  _max_template_cost = max_cost;
+  return *this;
+}
+
+OpTrie& OpTrie::set_template_stats(bool enabled) {
+  _template_stats = enabled;
+  return *this;
+}
+
+std::vector<TemplateStat> OpTrie::template_stats() const {
+  std::lock_guard<std::mutex> lock(_stats_mutex);
+  auto merged = _retired_stats;
+  {
+    auto frozen = _frozen.read();
+    auto totals = frozen->template_counters->collect();
+    for (size_t i = 0; i < totals.size(); ++i) {
+      auto& tpl = frozen->templates[i];
+      merged[std::string(frozen->str(tpl.tpl, tpl.tpl_len))] += totals[i];
+    }
+  }
+  std::vector<TemplateStat> stats;
+  stats.reserve(merged.size());
+  for (auto& kv : merged) {
+    stats.push_back({kv.first, kv.second});
+  }
+  return stats;
+}
+
+void OpTrie::reset_template_stats() {
+  std::lock_guard<std::mutex> lock(_stats_mutex);
+  _retired_stats.clear();
+  auto frozen = _frozen.read();
+  frozen->template_counters->reset();
+}
+
+void OpTrie::save(const std::string& path) const {
+  auto frozen = _frozen.read();
+  frozen->save(path);
+}
+
+OpTrie& OpTrie::open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  publish(FrozenTrie::open(path));
+  _read_only = true;
+  return *this;
+}
+
+OpTrie& OpTrie::share() {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  std::unique_ptr<FrozenTrie> shared;
+  {
+    // 读guard要在publish之前释放，publish会等所有读者离开
+    auto frozen = _frozen.read();
+    shared = frozen->to_shared_memory();
+  }
+  publish(std::move(shared));
+  _read_only = true;
+  // 构建用的树和词典不再需要，匹配只用共享内存中的镜像
+  _root = std::make_shared<RootOpNode>();
+  _ends.clear();
+  _pat_dic = std::make_shared<PatternDict>();
+#ifdef __GLIBC__
+  // 释放的内存还给系统，否则fork后仍作为写时复制的私有页留在每个子进程里
+  malloc_trim(0);
+#endif
+  return *this;
+}
+
+void OpTrie::check_writable() const {
+  if (_read_only) {
+    throw std::runtime_error("OpTrie opened from an image is read-only");
+  }
 }
 
 void OpTrie::show() const {
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  if (_read_only) {
+    std::cout << "<compiled image, " << _frozen.read()->nodes.size() << " nodes>" << std::endl;
+    return;
+  }
   _root->show();
 }
 
@@ -14,17 +14,180 @@ PYBIND11_MODULE(optrie, m) {
       "Default 64, lower for better performance in some cases,"
       "called before loading template files.",
       "max_match_len"_a);
+    py::enum_<MatchEngine>(m, "MatchEngine")
+        .value("DFS", MatchEngine::DFS)
+        .value("BITMASK", MatchEngine::BITMASK);
     py::class_<MatchResult>(m, "MatchResult")
         .def_readonly("matched", &MatchResult::matched)
         .def_readonly("score", &MatchResult::score)
         .def_readonly("groups", &MatchResult::groups)
         .def_readonly("extra_info", &MatchResult::extra)
-        .def_readonly("template", &MatchResult::tpl);
+        .def_readonly("template", &MatchResult::tpl)
+        .def_readonly("start", &MatchResult::start)
+        .def_readonly("end", &MatchResult::end)
+        .def_readonly("timed_out", &MatchResult::timed_out)
+#ifdef OPTRIE_MATCH_STATS
+        .def_readonly("stats", &MatchResult::stats)
+#endif
+        ;
+
+#ifdef OPTRIE_MATCH_STATS
+    py::class_<MatchStats>(m, "MatchStats")
+        .def_readonly("nodes_visited", &MatchStats::nodes_visited)
+        .def_readonly("memo_hits", &MatchStats::memo_hits)
+        .def_readonly("iterator_steps", &MatchStats::iterator_steps)
+        .def_readonly("dict_probes", &MatchStats::dict_probes)
+        .def_readonly("backtracks", &MatchStats::backtracks)
+        .def_readonly("max_depth", &MatchStats::max_depth);
+#endif
+    py::class_<ExplainCandidate>(m, "ExplainCandidate")
+        .def_readonly("node", &ExplainCandidate::node)
+        .def_readonly("expr", &ExplainCandidate::expr)
+        .def_readonly("lengths", &ExplainCandidate::lengths);
+    py::class_<ExplainStep>(m, "ExplainStep")
+        .def_readonly("parent", &ExplainStep::parent)
+        .def_readonly("node", &ExplainStep::node)
+        .def_readonly("expr", &ExplainStep::expr)
+        .def_readonly("template", &ExplainStep::tpl)
+        .def_readonly("depth", &ExplainStep::depth)
+        .def_readonly("start", &ExplainStep::start)
+        .def_readonly("length", &ExplainStep::length)
+        .def_readonly("memo_hit", &ExplainStep::memo_hit)
+        .def_readonly("accepted", &ExplainStep::accepted)
+        .def_readonly("fits_children", &ExplainStep::fits_children)
+        .def_readonly("backtracked", &ExplainStep::backtracked)
+        .def_readonly("candidates", &ExplainStep::candidates)
+        .def_readonly("cost", &ExplainStep::cost);
+    py::class_<ExplainResult>(m, "ExplainResult")
+        .def_readonly("result", &ExplainResult::result)
+        .def_readonly("steps", &ExplainResult::steps);
+    py::class_<TemplateCost>(m, "TemplateCost")
+        .def_readonly("template", &TemplateCost::tpl)
+        .def_readonly("branching", &TemplateCost::branching)
+        .def_readonly("cost", &TemplateCost::cost)
+        .def_readonly("variable_run", &TemplateCost::variable_run);
+    py::class_<SubtreeCost>(m, "SubtreeCost")
+        .def_readonly("prefix", &SubtreeCost::prefix)
+        .def_readonly("cost", &SubtreeCost::cost)
+        .def_readonly("num_children", &SubtreeCost::num_children);
+    py::class_<TemplateStat>(m, "TemplateStat")
+        .def_readonly("template", &TemplateStat::tpl)
+        .def_property_readonly("attempts", [](const TemplateStat& stat) { return stat.count.attempts; })
+        .def_property_readonly("hits", [](const TemplateStat& stat) { return stat.count.hits; })
+        .def_property_readonly("time_ns", [](const TemplateStat& stat) { return stat.count.time_ns; });
     py::class_<OpTrie>(m, "OpTrie")
         .def(py::init<>())
-        .def("load", &OpTrie::load, "load template and dict files", "template_files"_a, "dict_files"_a)
+        .def("load", &OpTrie::load, "load template and dict files, also hot-reloads dicts while matching",
+             "template_files"_a, "dict_files"_a, py::return_value_policy::reference_internal,
+             py::call_guard<py::gil_scoped_release>())
+        .def("load_from_memory", [](OpTrie& trie, py::object templates, py::object dicts) -> OpTrie& {
+               // 持有GIL时先转换成C++对象，构建时再释放
+               auto is_text = [](const py::object& obj) {
+                 return py::isinstance<py::bytes>(obj) || py::isinstance<py::str>(obj);
+               };
+               std::vector<std::string> lines;
+               if (is_text(templates)) {
+                 lines.emplace_back(templates.cast<std::string>());
+               } else {
+                 lines = templates.cast<std::vector<std::string>>();
+               }
+               if (is_text(dicts)) {
+                 auto dict_text = dicts.cast<std::string>();
+                 std::string template_text;
+                 for (auto& line : lines) {
+                   template_text += line;
+                   template_text += '\n';
+                 }
+                 py::gil_scoped_release release;
+                 return trie.load_from_text(template_text, dict_text);
+               }
+               auto dict_words = dicts.cast<std::map<std::string, std::vector<std::string>>>();
+               py::gil_scoped_release release;
+               return trie.load_from_memory(lines, dict_words);
+             },
+             "load templates and dicts from memory instead of files: templates is a list of template lines "
+             "or the whole template file content (str/bytes), dicts is {dict_name: [words]} "
+             "or the whole dict file content (str/bytes)",
+             "templates"_a, "dicts"_a = py::dict(), py::return_value_policy::reference_internal)
+        .def("add_template", &OpTrie::add_template,
+             "add a template line (tab separated, same as in template files) without a full rebuild",
+             "line"_a, py::return_value_policy::reference_internal, py::call_guard<py::gil_scoped_release>())
+        .def("add_templates", &OpTrie::add_templates,
+             "add template lines, publishing the updated trie once",
+             "lines"_a, py::return_value_policy::reference_internal, py::call_guard<py::gil_scoped_release>())
+        .def("remove_template", &OpTrie::remove_template,
+             "remove a template by its pattern (first column), return whether it existed",
+             "template"_a, py::call_guard<py::gil_scoped_release>())
+        .def("remove_templates", &OpTrie::remove_templates,
+             "remove templates by their patterns, return the number removed",
+             "templates"_a, py::call_guard<py::gil_scoped_release>())
         .def("show", &OpTrie::show, "print op trie")
-        .def("match", &OpTrie::match, "match string", "string"_a);
+        .def("set_engine", &OpTrie::set_engine,
+             "select the engine for whole-string matching, results are identical, "
+             "BITMASK falls back to DFS for strings longer than 63",
+             "engine"_a, py::return_value_policy::reference_internal)
+        .def_property_readonly("engine", &OpTrie::engine)
+        .def("save", &OpTrie::save,
+             "save the compiled trie and dicts as a versioned binary image",
+             "path"_a, py::call_guard<py::gil_scoped_release>())
+        .def("open", &OpTrie::open,
+             "mmap an image written by save and match on it directly (read-only afterwards)",
+             "path"_a, py::return_value_policy::reference_internal, py::call_guard<py::gil_scoped_release>())
+        .def("share", &OpTrie::share,
+             "move the compiled trie into read-only shared memory and free the build-time structures, "
+             "call in the master before forking workers (read-only afterwards)",
+             py::return_value_policy::reference_internal, py::call_guard<py::gil_scoped_release>())
+        .def("analyze", &OpTrie::analyze,
+             "estimate the worst-case backtracking cost of each template, most costly first, "
+             "top_k=0 returns all", "top_k"_a = 20)
+        .def("analyze_subtrees", &OpTrie::analyze_subtrees,
+             "estimate the worst-case backtracking cost of each subtree, most costly first, "
+             "top_k=0 returns all", "top_k"_a = 20)
+        .def("set_max_template_cost", &OpTrie::set_max_template_cost,
+             "templates whose estimated cost exceeds max_cost are rejected on later loads, 0 means no limit",
+             "max_cost"_a, py::return_value_policy::reference_internal)
+        .def("set_template_stats", &OpTrie::set_template_stats,
+             "enable or disable per-template counters (attempts, hits, time in subtree), "
+             "sharded per matching thread",
+             "enabled"_a = true, py::return_value_policy::reference_internal)
+        .def("template_stats", &OpTrie::template_stats,
+             "per-template counters since the last reset, sorted by template",
+             py::call_guard<py::gil_scoped_release>())
+        .def("reset_template_stats", &OpTrie::reset_template_stats, "reset per-template counters",
+             py::call_guard<py::gil_scoped_release>())
+        .def("match", [](const OpTrie& trie, std::wstring_view s, uint64_t max_steps, uint64_t deadline_us) {
+               return trie.match(s, MatchBudget{max_steps, deadline_us});
+             },
+             "match string, stop when max_steps nodes are expanded or deadline_us elapsed "
+             "(0 means unlimited) and set timed_out",
+             "string"_a, "max_steps"_a = 0, "deadline_us"_a = 0)
+        .def("match_batch", [](const OpTrie& trie, const std::vector<std::wstring>& strs, size_t num_threads,
+                               uint64_t max_steps, uint64_t deadline_us) {
+               return trie.match_batch(strs, num_threads, MatchBudget{max_steps, deadline_us});
+             },
+             "match a list of strings on native threads with the GIL released, "
+             "results are in input order, num_threads=0 uses all cores, the budget applies to each string",
+             "strings"_a, "num_threads"_a = 0, "max_steps"_a = 0, "deadline_us"_a = 0,
+             py::call_guard<py::gil_scoped_release>())
+        .def("match_best", [](const OpTrie& trie, std::wstring_view s, uint64_t max_steps, uint64_t deadline_us) {
+               return trie.match_best(s, MatchBudget{max_steps, deadline_us});
+             },
+             "match string, return the matched template with the highest score, "
+             "or the best found so far when the budget runs out (timed_out is set)",
+             "string"_a, "max_steps"_a = 0, "deadline_us"_a = 0)
+        .def("match_all", &OpTrie::match_all,
+             "match string, return all matched templates in the order they are found", "string"_a)
+        .def("match_topk", &OpTrie::match_topk,
+             "match string, return the k matched templates with the highest scores", "string"_a, "k"_a)
+        .def("explain", &OpTrie::explain,
+             "trace the DFS of match: nodes expanded, candidate lengths, pruning, backtracking "
+             "and the cost of each subtree", "string"_a)
+        .def("search", &OpTrie::search,
+             "find all occurrences of templates in text, ordered by start position", "string"_a)
+        .def("finditer", [](const OpTrie& trie, std::wstring_view s) {
+               return py::iter(py::cast(trie.search(s)));
+             },
+             "iterate over all occurrences of templates in text", "string"_a);
 }
 
 }  // namespace optrie
@@ -0,0 +1,87 @@
+#include <thread>
+#include "rcu.h"
+
+namespace optrie {
+
+namespace {
+
+// 读者登记槽，只增不删，线程退出后标记为空闲供其他线程复用
+struct ReaderSlot {
+  std::atomic<uint64_t> epoch{0};     // 进入读临界区时的全局epoch，0表示不在读
+  std::atomic<bool> in_use{true};
+  size_t depth = 0;                   // 嵌套深度，只有持有该槽的线程访问
+  ReaderSlot* next = nullptr;
+};
+
+std::atomic<uint64_t> g_epoch{1};
+std::atomic<ReaderSlot*> g_slots{nullptr};
+
+ReaderSlot* acquire_slot() {
+  for (auto slot = g_slots.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+    bool in_use = false;
+    if (!slot->in_use.load(std::memory_order_relaxed) &&
+        slot->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) {
+      return slot;
+    }
+  }
+  auto slot = new ReaderSlot();
+  slot->next = g_slots.load(std::memory_order_relaxed);
+  while (!g_slots.compare_exchange_weak(slot->next, slot,
+                                        std::memory_order_release, std::memory_order_relaxed)) {
+  }
+  return slot;
+}
+
+// 当前线程的槽，常量初始化的thread_local访问时不用检查是否已构造
+thread_local ReaderSlot* t_slot = nullptr;
+
+// 线程退出时归还槽
+struct LocalSlot {
+  LocalSlot() : slot(acquire_slot()) {}
+
+  ~LocalSlot() {
+    t_slot = nullptr;
+    slot->epoch.store(0, std::memory_order_release);
+    slot->in_use.store(false, std::memory_order_release);
+  }
+
+  ReaderSlot* slot;
+};
+
+inline ReaderSlot* local_slot() {
+  if (t_slot == nullptr) {
+    thread_local LocalSlot local;
+    t_slot = local.slot;
+  }
+  return t_slot;
+}
+
+}  // namespace
+
+void rcu_read_lock() {
+  auto slot = local_slot();
+  if (slot->depth++ == 0) {
+    // 先宣告epoch再读共享指针（都是seq_cst），写者换掉指针后一定能看到这次宣告
+    slot->epoch.store(g_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+  }
+}
+
+void rcu_read_unlock() {
+  auto slot = local_slot();
+  if (--slot->depth == 0) {
+    slot->epoch.store(0, std::memory_order_release);
+  }
+}
+
+void rcu_synchronize() {
+  // 之后进入的读者宣告的epoch不小于new_epoch，拿到的一定是新值
+  uint64_t new_epoch = g_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+  for (auto slot = g_slots.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+    uint64_t epoch;
+    while ((epoch = slot->epoch.load(std::memory_order_seq_cst)) != 0 && epoch < new_epoch) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+}  // namespace optrie
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <bitset>
+#include "template_cost.h"
+#include "op.h"
+
+namespace optrie {
+
+namespace {
+
+// 从ROOT到当前节点的路径信息
+struct PathState {
+  double branching;   // 切分数
+  size_t min_pos;     // 当前节点匹配结束的位置范围
+  size_t max_pos;
+  double cost;        // 路径上累计的候选数
+  uint32_t run;       // 以当前节点结尾的连续可变长节点数
+  uint32_t max_run;
+};
+
+// 节点自身能匹配的长度个数
+size_t num_lengths(const FrozenTrie& trie, const FrozenNode& node) {
+  size_t n = 0;
+  for (size_t i = 0; i < trie.length_set_words; ++i) {
+    n += std::bitset<64>(trie.length_words[node.lengths + i]).count();
+  }
+  return n;
+}
+
+class CostAnalyzer {
+ public:
+  CostAnalyzer(const FrozenTrie& trie, std::vector<TemplateCost>* templates, std::vector<SubtreeCost>* subtrees)
+      : _trie(trie), _templates(templates), _subtrees(subtrees), _lengths(trie.nodes.size()) {
+    for (size_t i = 0; i < _lengths.size(); ++i) {
+      _lengths[i] = num_lengths(trie, trie.nodes[i]);
+    }
+  }
+
+  // 分析node_id的子树，返回子树的最坏候选数
+  double analyze(uint32_t node_id, const PathState& state, const std::string& prefix) {
+    auto& node = _trie.nodes[node_id];
+    // 子节点的起始位置数：不超过切分数，也不超过可能的位置个数（整串匹配的串长不超过MAX_LEN）
+    size_t max_pos = min(state.max_pos, MAX_LEN);
+    double reach = state.min_pos > max_pos ? 0 : std::min(state.branching, double(max_pos - state.min_pos + 1));
+    // 每个可达位置上都要尝试各个子节点，兄弟越多、越宽，经过这里的模板越慢
+    double fan_out = reach * children_lengths(node_id);
+    if (_templates != nullptr) {
+      // 等价的模板项共用终止节点，开销相同
+      for (uint32_t id = node.tpl_id, end = id + _trie.num_templates(node); id < end; ++id) {
+        auto& c = (*_templates)[id];
+        c.branching = state.branching;
+        c.cost = state.cost;
+        c.variable_run = state.max_run;
+      }
+    }
+    double work = fan_out;
+    for (uint32_t child = node.child_begin; child < node.child_end; ++child) {
+      auto& child_node = _trie.nodes[child];
+      size_t b = _lengths[child];
+      PathState next;
+      next.branching = state.branching * b;
+      next.min_pos = state.min_pos + child_node.min_len;
+      next.max_pos = state.max_pos + child_node.max_len;
+      next.cost = state.cost + fan_out;
+      next.run = b > 1 ? state.run + 1 : 0;
+      next.max_run = std::max(state.max_run, next.run);
+      work += analyze(child, next, _subtrees != nullptr ? prefix + std::string(_trie.expr(child)) : prefix);
+    }
+    if (_subtrees != nullptr && node.child_begin < node.child_end) {
+      _subtrees->push_back({prefix, work, node.child_end - node.child_begin});
+    }
+    return work;
+  }
+
+ private:
+  // 在一个位置上最多尝试的子节点候选长度数
+  // 有分派表时只尝试首字符对得上的一格和总要尝试的子节点，按最大的一格算
+  double children_lengths(uint32_t node_id) const {
+    auto& node = _trie.nodes[node_id];
+    if (!node.dispatched) {
+      double n = 0;
+      for (uint32_t child = node.child_begin; child < node.child_end; ++child) {
+        n += _lengths[child];
+      }
+      return n;
+    }
+    auto& dispatch = _trie.dispatches[_trie.node_dispatch[node_id]];
+    auto sum = [&](uint32_t begin, uint32_t end) {
+      double n = 0;
+      for (uint32_t i = begin; i < end; ++i) {
+        n += _lengths[_trie.dispatch_children[i]];
+      }
+      return n;
+    };
+    double max_slot = 0;
+    for (uint32_t i = dispatch.slot_begin; i < dispatch.slot_begin + dispatch.num_slots; ++i) {
+      auto& slot = _trie.dispatch_slots[i];
+      if (slot.end != 0) {
+        max_slot = std::max(max_slot, sum(slot.begin, slot.end));
+      }
+    }
+    return sum(dispatch.any_begin, dispatch.any_end) + max_slot;
+  }
+
+  const FrozenTrie& _trie;
+  std::vector<TemplateCost>* _templates;
+  std::vector<SubtreeCost>* _subtrees;
+  std::vector<size_t> _lengths;  // 各节点自身能匹配的长度个数
+};
+
+}  // namespace
+
+std::vector<TemplateCost> analyze_templates(const FrozenTrie& trie) {
+  std::vector<TemplateCost> costs(trie.templates.size());
+  for (size_t i = 0; i < costs.size(); ++i) {
+    auto& tpl = trie.templates[i];
+    costs[i].tpl = trie.str(tpl.tpl, tpl.tpl_len);
+  }
+  CostAnalyzer(trie, &costs, nullptr).analyze(0, PathState{1, 0, 0, 0, 0, 0}, "");
+  return costs;
+}
+
+std::vector<SubtreeCost> analyze_subtrees(const FrozenTrie& trie) {
+  std::vector<SubtreeCost> costs;
+  CostAnalyzer(trie, nullptr, &costs).analyze(0, PathState{1, 0, 0, 0, 0, 0}, "");
+  return costs;
+}
+
+}  // namespace optrie
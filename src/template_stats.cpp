@@ -0,0 +1,78 @@
+#include "template_stats.h"
+
+namespace optrie {
+
+namespace {
+
+std::atomic<uint64_t> g_counters_id{1};
+
+// 当前线程最近用过的分片，同一线程连续匹配同一棵树时不用加锁查找
+struct ShardCache {
+  uint64_t id = 0;
+  TemplateCounters::Counter* counters = nullptr;
+};
+
+thread_local ShardCache t_cache;
+
+}  // namespace
+
+TemplateCounters::TemplateCounters(size_t num_templates)
+    : _num_templates(num_templates), _id(g_counters_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+TemplateCounters::Counter* TemplateCounters::shard() {
+  if (t_cache.id == _id) {
+    return t_cache.counters;
+  }
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto owner = std::this_thread::get_id();
+  Counter* counters = nullptr;
+  // 线程id可能被退出的线程复用，此时旧线程已不再写，接着用它的分片
+  for (auto& shard : _shards) {
+    if (shard.owner == owner) {
+      counters = shard.counters.get();
+      break;
+    }
+  }
+  if (counters == nullptr) {
+    _shards.push_back({owner, std::unique_ptr<Counter[]>(new Counter[_num_templates])});
+    counters = _shards.back().counters.get();
+  }
+  t_cache = {_id, counters};
+  return counters;
+}
+
+bool TemplateCounters::active() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return !_shards.empty();
+}
+
+std::vector<TemplateCount> TemplateCounters::sum() const {
+  std::vector<TemplateCount> totals(_num_templates);
+  for (auto& shard : _shards) {
+    for (size_t i = 0; i < _num_templates; ++i) {
+      auto& c = shard.counters[i];
+      totals[i].attempts += c.attempts.load(std::memory_order_relaxed);
+      totals[i].hits += c.hits.load(std::memory_order_relaxed);
+      totals[i].time_ns += c.time_ns.load(std::memory_order_relaxed);
+    }
+  }
+  return totals;
+}
+
+std::vector<TemplateCount> TemplateCounters::collect() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto totals = sum();
+  for (size_t i = 0; i < _baseline.size(); ++i) {
+    totals[i].attempts -= _baseline[i].attempts;
+    totals[i].hits -= _baseline[i].hits;
+    totals[i].time_ns -= _baseline[i].time_ns;
+  }
+  return totals;
+}
+
+void TemplateCounters::reset() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _baseline = sum();
+}
+
+}  // namespace optrie
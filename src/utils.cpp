@@ -1,8 +1,19 @@
 #include "utils.h"
 
 #include <algorithm>
+#include <atomic>
 #include <codecvt>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <locale>
+#include <memory>
+#include <mutex>
+#include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 namespace optrie {
 
@@ -18,6 +29,31 @@ size_t relu(int64_t x) {
   return static_cast<size_t>(x < 0 ? 0 : x);
 }
 
+size_t highest_bit(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - static_cast<size_t>(__builtin_clzll(x));
+#else
+  size_t bit = 0;
+  while (x >>= 1) {
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+size_t lowest_bit(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<size_t>(__builtin_ctzll(x));
+#else
+  size_t bit = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
 void split(const std::string& str, char sep, std::vector<std::string>& result) {
   result.clear();
   std::string::size_type last = 0, pos = 0;
@@ -46,27 +82,38 @@ std::string trim(const std::string& str) {
   return ltrim(rtrim(str));
 }
 
+std::string_view trim_view(std::string_view str) {
+  auto is_space = [](unsigned char chr) {
+    return std::isspace(chr);
+  };
+  while (!str.empty() && is_space(str.front())) {
+    str.remove_prefix(1);
+  }
+  while (!str.empty() && is_space(str.back())) {
+    str.remove_suffix(1);
+  }
+  return str;
+}
+
 using cvt = std::codecvt_utf8<wchar_t>;
-std::wstring_convert<cvt, wchar_t> converter;
+// wstring_convert有内部状态，并行加载时每个线程各用一个
+thread_local std::wstring_convert<cvt, wchar_t> converter;
 
-std::wstring utf8_to_wstring(const std::string& str) {
-  return converter.from_bytes(str);
+std::wstring utf8_to_wstring(std::string_view str) {
+  return converter.from_bytes(str.data(), str.data() + str.size());
 }
 
 std::string wstring_to_utf8(const std::wstring& str) {
   return converter.to_bytes(str);
 }
 
-std::wstring to_lower(const std::wstring& str) {
-  std::wstring ret;
-  for (auto wch : str) {
+std::wstring to_lower(std::wstring str) {
+  for (auto& wch : str) {
     if (wch >= 65 && wch <= 90) {
-      ret += static_cast<wchar_t>(wch + 32);
-    } else {
-      ret += wch;
+      wch = static_cast<wchar_t>(wch + 32);
     }
   }
-  return ret;
+  return str;
 }
 
 void replace_all(std::string& s, const std::string& from, const std::string& to) {
@@ -77,4 +124,159 @@ void replace_all(std::string& s, const std::string& from, const std::string& to)
   }
 }
 
+bool read_file(const std::string& path, std::string& content) {
+  std::ifstream fi(path, std::ios::binary | std::ios::ate);
+  if (!fi.is_open()) {
+    return false;
+  }
+  content.resize(static_cast<size_t>(fi.tellg()));
+  fi.seekg(0);
+  fi.read(&content[0], content.size());
+  return static_cast<bool>(fi);
+}
+
+void split_chunks(std::string_view text, size_t chunk_size, std::vector<std::string_view>& chunks) {
+  chunks.clear();
+  while (!text.empty()) {
+    size_t end = text.size();
+    if (chunk_size < text.size()) {
+      end = text.find('\n', chunk_size);
+      end = end == std::string_view::npos ? text.size() : end + 1;
+    }
+    chunks.emplace_back(text.substr(0, end));
+    text.remove_prefix(end);
+  }
+}
+
+namespace {
+
+// 一次parallel_for的共享状态，排队中还没开始的协助任务也持有它，调用返回后仍然有效
+struct ParallelJob {
+  const std::function<void(size_t)>* task;
+  size_t num_tasks;
+  std::atomic<size_t> next_task{0};
+  std::atomic<bool> failed{false};
+  std::exception_ptr error = nullptr;
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t active = 0;    // 正在领取任务的协助线程数
+  bool closed = false;  // 调用方已领完任务，之后开始的协助任务直接返回
+
+  // 领取并执行任务，直到领完或有任务失败
+  void run() {
+    try {
+      size_t i;
+      while (!failed && (i = next_task.fetch_add(1)) < num_tasks) {
+        (*task)(i);
+      }
+    } catch (...) {
+      if (!failed.exchange(true)) {
+        error = std::current_exception();
+      }
+    }
+  }
+
+  // 在工作线程上协助执行
+  void help() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (closed) {
+        return;
+      }
+      ++active;
+    }
+    run();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--active == 0) {
+      done.notify_all();
+    }
+  }
+};
+
+// 常驻的工作线程池，进程内共用：批量匹配不用每次创建线程，
+// 工作线程上的线程局部缓冲（memo、结果缓冲、模板统计分片）也在多次调用间复用
+// 线程按需增加，不超过调用方要的线程数；线程分离，进程退出时不用等待
+class WorkerPool {
+ public:
+  // 当前进程的线程池；fork出的子进程里没有父进程的工作线程，重新建一个（旧的不能析构，直接丢弃）
+  static WorkerPool& instance() {
+    static std::mutex mutex;
+    static WorkerPool* pool = nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+#ifndef _WIN32
+    if (pool != nullptr && pool->_pid != getpid()) {
+      pool = nullptr;
+    }
+#endif
+    if (pool == nullptr) {
+      pool = new WorkerPool();
+    }
+    return *pool;
+  }
+
+  // 提交num_helpers个协助任务，工作线程不够时补上
+  void submit(const std::shared_ptr<ParallelJob>& job, size_t num_helpers) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < num_helpers; ++i) {
+      _queue.emplace_back(job);
+    }
+    while (_num_workers < num_helpers) {
+      std::thread([this] { work(); }).detach();
+      ++_num_workers;
+    }
+    _ready.notify_all();
+  }
+
+ private:
+  WorkerPool() {
+#ifndef _WIN32
+    _pid = getpid();
+#endif
+  }
+
+  void work() {
+    while (true) {
+      std::shared_ptr<ParallelJob> job;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [this] { return !_queue.empty(); });
+        job = std::move(_queue.front());
+        _queue.pop_front();
+      }
+      job->help();
+    }
+  }
+
+  std::mutex _mutex;
+  std::condition_variable _ready;
+  std::deque<std::shared_ptr<ParallelJob>> _queue;
+  size_t _num_workers = 0;
+#ifndef _WIN32
+  pid_t _pid;
+#endif
+};
+
+}  // namespace
+
+void parallel_for(size_t num_tasks, const std::function<void(size_t)>& task, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = max(1, std::thread::hardware_concurrency());
+  }
+  num_threads = min(num_threads, num_tasks);
+  auto job = std::make_shared<ParallelJob>();
+  job->task = &task;
+  job->num_tasks = num_tasks;
+  if (num_threads > 1) {
+    WorkerPool::instance().submit(job, num_threads - 1);
+  }
+  // 当前线程也参与，工作线程都忙（如嵌套调用）时由它做完全部任务，不会互相等待
+  job->run();
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->closed = true;
+  job->done.wait(lock, [&] { return job->active == 0; });
+  if (job->error) {
+    std::rethrow_exception(job->error);
+  }
+}
+
 }  // namespace optrie
\ No newline at end of file
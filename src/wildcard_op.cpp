@@ -1,9 +1,17 @@
 #include "wildcard_op.h"
+#include "frozen_trie.h"
 
 namespace optrie {
 
 void WildcardOpNode::init() {
   size_t min_len = 0, max_len = 0;
+  parse_range(expr, min_len, max_len);
+  set_max_len(max_len);
+  set_min_len(min_len);
+}
+
+void WildcardOpNode::parse_range(const std::string& expr, size_t& min_len, size_t& max_len) {
+  min_len = 0;
   std::vector<std::string> range;
   split(expr.substr(3, expr.length() - 4), '-', range);
   if (range.size() == 1) {
@@ -14,19 +22,18 @@ void WildcardOpNode::init() {
   } else {
     throw std::runtime_error("Invalid range " + expr);
   }
-  assert(max_len >= min_len);
-  set_max_len(max_len);
-  set_min_len(min_len);
+  if (max_len < min_len) {
+    throw std::runtime_error("Invalid range " + expr);
+  }
 }
 
-MatchIterator WildcardOpNode::match(const std::wstring& s, size_t start) const {
-  size_t max_len = min(_max_len, relu(s.length() - start - _child_min_len));
-  size_t min_len = max(_min_len, relu(s.length() - start - _child_max_len));
-  return MatchIterator(this, s, start, min_len, max_len, 1);
+std::string WildcardOpNode::canonical_expr(size_t min_len, size_t max_len) {
+  return "[W:" + std::to_string(min_len) + "-" + std::to_string(max_len) + "]";
 }
 
-bool WildcardOpNode::match_next(const std::wstring& s, size_t start, size_t length) const {
-  return true;
+void WildcardOpNode::freeze(FrozenNode& node, FrozenTrieBuilder& builder) const {
+  OpNode::freeze(node, builder);
+  node.kind = OpKind::WILDCARD;
 }
 
 }  // namespace optrie